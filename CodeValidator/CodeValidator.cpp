@@ -1,6 +1,8 @@
 // CodeValidator.cpp : Main application file
 // A Windows application that validates code files for compilation/runtime errors
 
+#include <winsock2.h>
+#include <ws2tcpip.h>
 #include <Windows.h>
 #include <array>
 #include <string>
@@ -14,8 +16,27 @@
 #include <thread>
 #include <mutex>
 #include <regex>
+#include <map>
+#include <set>
+#include <functional>
+#include <condition_variable>
+#include <deque>
+#include <cstdint>
+#include <cstring>
+#include <cctype>
+#include <algorithm>
+#include <string_view>
+#include <chrono>
+#include <atomic>
+#include <iostream>
+#include <shellapi.h>
+#include <pdh.h>
 
 #pragma comment(lib, "comctl32.lib")
+#pragma comment(lib, "shell32.lib")
+#pragma comment(lib, "advapi32.lib")
+#pragma comment(lib, "ws2_32.lib")
+#pragma comment(lib, "pdh.lib")
 #pragma comment(linker,"\"/manifestdependency:type='win32' name='Microsoft.Windows.Common-Controls' version='6.0.0.0' processorArchitecture='*' publicKeyToken='6595b64144ccf1df' language='*'\"")
 
 LRESULT CALLBACK WindowProc(HWND hwnd, UINT uMsg, WPARAM wParam, LPARAM lParam);
@@ -27,168 +48,6509 @@ constexpr int IDC_LANGUAGE_COMBO = 103;
 constexpr int IDC_FILEPATH_EDIT = 104;
 constexpr int IDC_RESULT_EDIT = 105;
 
+// Named pipe the validation daemon listens on
+constexpr wchar_t DAEMON_PIPE_NAME[] = L"\\\\.\\pipe\\CodeValidatorDaemon";
+
 HWND g_hwndFilePath;
 HWND g_hwndResultEdit;
 HWND g_hwndLanguageCombo;
 std::mutex g_mutex;
 bool g_validationInProgress = false;
 
-class LanguageValidator {
-public:
-    virtual ~LanguageValidator() = default;
-    virtual std::string validate(const std::string& filePath) = 0;
-    virtual bool isCompatible(const std::string& filePath) = 0;
+using HandleGuard = std::unique_ptr<void, decltype(&CloseHandle)>;
+
+std::string toUtf8(const std::wstring& wide) {
+    int size_needed = WideCharToMultiByte(CP_UTF8, 0, wide.c_str(), -1, nullptr, 0, nullptr, nullptr);
+    std::string result(size_needed, 0);
+    WideCharToMultiByte(CP_UTF8, 0, wide.c_str(), -1, &result[0], size_needed, nullptr, nullptr);
+    result.resize(size_needed - 1);
+    return result;
+}
+
+std::wstring toWide(std::string_view text) {
+    int size_needed = MultiByteToWideChar(CP_UTF8, 0, text.data(), static_cast<int>(text.size()), nullptr, 0);
+    std::wstring result(size_needed, 0);
+    MultiByteToWideChar(CP_UTF8, 0, text.data(), static_cast<int>(text.size()), result.data(), size_needed);
+    return result;
+}
+
+std::string readEnvironment(const wchar_t* name, const std::string& fallback = "") {
+    DWORD size = GetEnvironmentVariableW(name, nullptr, 0);
+    if (size == 0) {
+        return fallback;
+    }
+    std::wstring value(size, 0);
+    value.resize(GetEnvironmentVariableW(name, &value[0], size));
+    return toUtf8(value);
+}
+
+uintmax_t readEnvironmentNumber(const wchar_t* name, uintmax_t fallback) {
+    try {
+        return std::stoull(readEnvironment(name, std::to_string(fallback)));
+    }
+    catch (...) {
+        return fallback;
+    }
+}
+
+// Per-user directory for generated helper files and caches
+std::filesystem::path appDataDirectory() {
+    std::filesystem::path directory(toWide(readEnvironment(L"LOCALAPPDATA", ".")));
+    directory /= "CodeValidator";
+    std::error_code ec;
+    std::filesystem::create_directories(directory, ec);
+    return directory;
+}
+
+// Deletes the least recently written files under a cache directory until it fits in maxBytes
+void trimDirectory(const std::filesystem::path& directory, uintmax_t maxBytes) {
+    struct Entry {
+        std::filesystem::path path;
+        std::filesystem::file_time_type modified;
+        uintmax_t size;
+    };
+
+    std::error_code ec;
+    std::vector<Entry> entries;
+    uintmax_t total = 0;
+    for (auto it = std::filesystem::recursive_directory_iterator(directory, ec); !ec && it != std::filesystem::recursive_directory_iterator(); it.increment(ec)) {
+        if (it->is_regular_file(ec)) {
+            Entry entry{ it->path(), it->last_write_time(ec), it->file_size(ec) };
+            total += entry.size;
+            entries.push_back(std::move(entry));
+        }
+    }
+    if (total <= maxBytes) {
+        return;
+    }
+
+    std::sort(entries.begin(), entries.end(), [](const Entry& a, const Entry& b) { return a.modified < b.modified; });
+    for (const auto& entry : entries) {
+        if (total <= maxBytes) {
+            break;
+        }
+        if (std::filesystem::remove(entry.path, ec)) {
+            total -= entry.size;
+        }
+    }
+}
+
+std::string readFileContents(const std::filesystem::path& path) {
+    std::ifstream file(path, std::ios::binary);
+    return std::string((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+}
+
+// Normalized absolute path used as a file's key in dependency indexes and results
+std::string fileKey(const std::filesystem::path& path) {
+    std::error_code ec;
+    return toUtf8(std::filesystem::absolute(path, ec).lexically_normal().generic_wstring());
+}
+
+std::string trimString(const std::string& text) {
+    size_t start = text.find_first_not_of(" \t\r\n");
+    if (start == std::string::npos) {
+        return "";
+    }
+    return text.substr(start, text.find_last_not_of(" \t\r\n") - start + 1);
+}
+
+// Writes a generated file only when its contents differ, keeping its timestamp stable otherwise
+void writeFileIfChanged(const std::filesystem::path& path, const std::string& content) {
+    std::ifstream existing(path, std::ios::binary);
+    std::string current((std::istreambuf_iterator<char>(existing)), std::istreambuf_iterator<char>());
+    if (existing.is_open() && current == content) {
+        return;
+    }
+    existing.close();
+    std::ofstream(path, std::ios::binary | std::ios::trunc) << content;
+}
+
+std::string quoteArgument(const std::string& argument) {
+    return "\"" + argument + "\"";
+}
+
+// Scheduling class of validation work. Interactive requests, such as a file the user just
+// opened or saved, are served ahead of background work such as batch runs.
+enum class Priority {
+    Background,
+    Interactive,
+};
+
+// Priority of the work running on this thread. Engine workers set it for each job; other
+// threads only ever validate on the user's behalf.
+thread_local Priority t_priority = Priority::Interactive;
+
+constexpr uintmax_t DEFAULT_SANDBOX_MEMORY_MB = 2048;
+constexpr uintmax_t DEFAULT_SANDBOX_PROCESSES = 64;
+constexpr uintmax_t DEFAULT_SANDBOX_CPUS = 2;
+
+// Limits every command the validators start runs under, adjustable through the environment
+struct SandboxLimits {
+    bool enabled = true;
+    uintmax_t memoryMB = 0;
+    DWORD activeProcesses = 0;
+    // Hard CPU cap in hundredths of a percent of all processors, 0 for none
+    DWORD cpuRate = 0;
+
+    static const SandboxLimits& current() {
+        static const SandboxLimits limits = [] {
+            SandboxLimits result;
+            result.enabled = readEnvironment(L"CODEVALIDATOR_SANDBOX", "1") != "0";
+            result.memoryMB = readEnvironmentNumber(L"CODEVALIDATOR_SANDBOX_MEMORY_MB", DEFAULT_SANDBOX_MEMORY_MB);
+            result.activeProcesses = static_cast<DWORD>(readEnvironmentNumber(L"CODEVALIDATOR_SANDBOX_PROCESSES", DEFAULT_SANDBOX_PROCESSES));
+            uintmax_t cpus = readEnvironmentNumber(L"CODEVALIDATOR_SANDBOX_CPUS", DEFAULT_SANDBOX_CPUS);
+            uintmax_t processors = std::max(1u, std::thread::hardware_concurrency());
+            if (cpus > 0 && cpus < processors) {
+                result.cpuRate = static_cast<DWORD>(cpus * 10000 / processors);
+            }
+            return result;
+        }();
+        return limits;
+    }
+};
+
+// Job object carrying the sandbox limits. Closing it kills whatever still runs inside.
+// The memory ceiling covers the whole process tree and can change between commands; when a
+// command hits it, the job is killed and the violation is remembered until the next reset.
+// Each reset starts a new lease, and notifications left over from an earlier lease are
+// ignored, so they can neither kill nor be blamed on the next command.
+class SandboxJob {
+public:
+    SandboxJob(const SandboxJob&) = delete;
+    SandboxJob& operator=(const SandboxJob&) = delete;
+
+    // Null when sandboxing is off or the job cannot be created
+    static std::unique_ptr<SandboxJob> create() {
+        const SandboxLimits& limits = SandboxLimits::current();
+        if (!limits.enabled) {
+            return nullptr;
+        }
+        HANDLE handle = CreateJobObjectW(nullptr, nullptr);
+        if (!handle) {
+            return nullptr;
+        }
+        std::unique_ptr<SandboxJob> job(new SandboxJob(handle));
+        job->setMemoryLimit(0);
+
+        if (limits.cpuRate > 0) {
+            JOBOBJECT_CPU_RATE_CONTROL_INFORMATION cpu{};
+            cpu.ControlFlags = JOB_OBJECT_CPU_RATE_CONTROL_ENABLE | JOB_OBJECT_CPU_RATE_CONTROL_HARD_CAP;
+            cpu.CpuRate = limits.cpuRate;
+            SetInformationJobObject(handle, JobObjectCpuRateControlInformation, &cpu, sizeof(cpu));
+        }
+
+        // No access to other processes' windows, the clipboard, desktops or system settings
+        JOBOBJECT_BASIC_UI_RESTRICTIONS ui{ JOB_OBJECT_UILIMIT_HANDLES | JOB_OBJECT_UILIMIT_READCLIPBOARD
+            | JOB_OBJECT_UILIMIT_WRITECLIPBOARD | JOB_OBJECT_UILIMIT_SYSTEMPARAMETERS | JOB_OBJECT_UILIMIT_DISPLAYSETTINGS
+            | JOB_OBJECT_UILIMIT_GLOBALATOMS | JOB_OBJECT_UILIMIT_DESKTOP | JOB_OBJECT_UILIMIT_EXITWINDOWS };
+        SetInformationJobObject(handle, JobObjectBasicUIRestrictions, &ui, sizeof(ui));
+
+        job->watchLimits();
+        return job;
+    }
+
+    ~SandboxJob() {
+        {
+            std::lock_guard<std::mutex> lock(registryMutex());
+            registry().erase(m_id);
+        }
+        CloseHandle(m_handle);
+    }
+
+    HANDLE handle() const {
+        return m_handle;
+    }
+
+    // Sets the ceiling in MB for the whole job; 0 selects the sandbox default
+    void setMemoryLimit(uintmax_t megabytes) {
+        const SandboxLimits& limits = SandboxLimits::current();
+        megabytes = megabytes > 0 ? megabytes : limits.memoryMB;
+        if (megabytes == m_memoryMB) {
+            return;
+        }
+
+        // Crashing programs exit at once instead of waiting on an error reporting dialog
+        JOBOBJECT_EXTENDED_LIMIT_INFORMATION extended{};
+        extended.BasicLimitInformation.LimitFlags = JOB_OBJECT_LIMIT_KILL_ON_JOB_CLOSE | JOB_OBJECT_LIMIT_DIE_ON_UNHANDLED_EXCEPTION;
+        if (megabytes > 0) {
+            extended.BasicLimitInformation.LimitFlags |= JOB_OBJECT_LIMIT_JOB_MEMORY;
+            extended.JobMemoryLimit = static_cast<SIZE_T>(megabytes * 1024 * 1024);
+        }
+        if (limits.activeProcesses > 0) {
+            extended.BasicLimitInformation.LimitFlags |= JOB_OBJECT_LIMIT_ACTIVE_PROCESS;
+            extended.BasicLimitInformation.ActiveProcessLimit = limits.activeProcesses;
+        }
+        if (SetInformationJobObject(m_handle, JobObjectExtendedLimitInformation, &extended, sizeof(extended))) {
+            m_memoryMB = megabytes;
+        }
+    }
+
+    uintmax_t memoryLimit() const {
+        return m_memoryMB;
+    }
+
+    // Waits for the notifications already queued for the job to be handled first, since a
+    // program that fails an allocation can exit on its own before they are
+    bool memoryLimitExceeded() {
+        HANDLE port = limitPort();
+        if (port) {
+            std::unique_lock<std::mutex> lock(registryMutex());
+            uint64_t request = ++m_flushRequested;
+            if (PostQueuedCompletionStatus(port, FLUSH_MESSAGE, m_id, reinterpret_cast<LPOVERLAPPED>(static_cast<ULONG_PTR>(request)))) {
+                flushed().wait_for(lock, std::chrono::seconds(1), [&] { return m_flushed >= request; });
+            }
+        }
+        return m_memoryLimitExceeded;
+    }
+
+    // Kills everything in the job because the work it runs for was abandoned
+    void cancel() {
+        m_cancelled = true;
+        TerminateJobObject(m_handle, 1);
+    }
+
+    bool cancelled() const {
+        return m_cancelled;
+    }
+
+    // Kills anything still running in the job and clears the kill flags for the next command.
+    // Notifications of the old lease may still be queued; the marker posted behind them tells
+    // the monitor thread where the new lease begins.
+    void reset() {
+        TerminateJobObject(m_handle, 1);
+        std::lock_guard<std::mutex> lock(registryMutex());
+        m_generation++;
+        m_memoryLimitExceeded = false;
+        m_cancelled = false;
+        HANDLE port = limitPort();
+        if (port && !PostQueuedCompletionStatus(port, LEASE_MESSAGE, m_id, reinterpret_cast<LPOVERLAPPED>(static_cast<ULONG_PTR>(m_generation)))) {
+            // Without the marker stale notifications cannot be told apart, so none are trusted
+            m_watchedGeneration = 0;
+        }
+    }
+
+private:
+    explicit SandboxJob(HANDLE handle) : m_handle(handle) {
+        static std::atomic<ULONG_PTR> nextId{ 1 };
+        m_id = nextId++;
+    }
+
+    static std::mutex& registryMutex() {
+        static std::mutex mutex;
+        return mutex;
+    }
+
+    static std::map<ULONG_PTR, SandboxJob*>& registry() {
+        static std::map<ULONG_PTR, SandboxJob*> jobs;
+        return jobs;
+    }
+
+    static std::condition_variable& flushed() {
+        static std::condition_variable condition;
+        return condition;
+    }
+
+    // Completion packets we post ourselves, next to the job notifications
+    static constexpr DWORD LEASE_MESSAGE = 0x10000;
+    static constexpr DWORD FLUSH_MESSAGE = 0x10001;
+
+    // Limit notifications of every job arrive on one completion port, keyed by job id, and
+    // are handled by a single thread started with the first job. Packets are handled in the
+    // order they were queued, so a lease marker separates a job's notifications by lease.
+    static HANDLE limitPort() {
+        static const HANDLE port = [] {
+            HANDLE completionPort = CreateIoCompletionPort(INVALID_HANDLE_VALUE, nullptr, 0, 1);
+            if (completionPort) {
+                std::thread([completionPort]() {
+                    DWORD message = 0;
+                    ULONG_PTR key = 0;
+                    LPOVERLAPPED overlapped = nullptr;
+                    while (GetQueuedCompletionStatus(completionPort, &message, &key, &overlapped, INFINITE)) {
+                        std::lock_guard<std::mutex> lock(registryMutex());
+                        auto it = registry().find(key);
+                        if (it == registry().end()) {
+                            continue;
+                        }
+                        SandboxJob* job = it->second;
+                        uint64_t value = reinterpret_cast<ULONG_PTR>(overlapped);
+                        if (message == LEASE_MESSAGE) {
+                            job->m_watchedGeneration = value;
+                        }
+                        else if (message == FLUSH_MESSAGE) {
+                            job->m_flushed = std::max(job->m_flushed, value);
+                            flushed().notify_all();
+                        }
+                        else if ((message == JOB_OBJECT_MSG_JOB_MEMORY_LIMIT || message == JOB_OBJECT_MSG_PROCESS_MEMORY_LIMIT)
+                            && job->m_watchedGeneration == job->m_generation) {
+                            job->m_memoryLimitExceeded = true;
+                            TerminateJobObject(job->m_handle, 1);
+                        }
+                    }
+                }).detach();
+            }
+            return completionPort;
+        }();
+        return port;
+    }
+
+    // Registers the job with the monitor thread and routes its notifications to the port
+    void watchLimits() {
+        HANDLE port = limitPort();
+        if (!port) {
+            return;
+        }
+
+        {
+            std::lock_guard<std::mutex> lock(registryMutex());
+            registry()[m_id] = this;
+        }
+        JOBOBJECT_ASSOCIATE_COMPLETION_PORT association{ reinterpret_cast<LPVOID>(m_id), port };
+        SetInformationJobObject(m_handle, JobObjectAssociateCompletionPortInformation, &association, sizeof(association));
+    }
+
+    HANDLE m_handle;
+    ULONG_PTR m_id = 0;
+    uintmax_t m_memoryMB = UINTMAX_MAX;
+    std::atomic<bool> m_memoryLimitExceeded{ false };
+    std::atomic<bool> m_cancelled{ false };
+    // Guarded by the registry mutex: the current lease, the lease whose notifications the
+    // monitor thread is reading, and the flushes asked for and done
+    uint64_t m_generation = 1;
+    uint64_t m_watchedGeneration = 1;
+    uint64_t m_flushRequested = 0;
+    uint64_t m_flushed = 0;
+};
+
+// Appends the reason a sandbox job was killed, if it was, to the output of its command
+void appendKillReason(SandboxJob* job, std::string& output) {
+    bool memoryLimitExceeded = job && job->memoryLimitExceeded();
+    if (!job || (!memoryLimitExceeded && !job->cancelled())) {
+        return;
+    }
+    if (!output.empty() && output.back() != '\n') {
+        output += '\n';
+    }
+    if (memoryLimitExceeded) {
+        output += "Killed: memory limit exceeded (" + std::to_string(job->memoryLimit()) + " MB)";
+    }
+    else {
+        output += "Killed: the batch stopped";
+    }
+}
+
+class CancellationGroup;
+
+// Group of the batch this thread is validating for, if any
+thread_local CancellationGroup* t_cancellation = nullptr;
+
+// The jobs running on behalf of one batch. Cancelling the group kills them and keeps the
+// batch's threads from starting new processes; other work in the process, such as warm
+// interpreter spares and background builds, is left alone. A group lives as long as its
+// batch, so nothing stays cancelled after it.
+class CancellationGroup {
+public:
+    // Makes the calling thread work for the group, which may be null, for its lifetime
+    class Scope {
+    public:
+        explicit Scope(CancellationGroup* group) : m_previous(t_cancellation) {
+            t_cancellation = group;
+        }
+        Scope(const Scope&) = delete;
+        Scope& operator=(const Scope&) = delete;
+        ~Scope() {
+            t_cancellation = m_previous;
+        }
+
+    private:
+        CancellationGroup* m_previous;
+    };
+
+    // Counts a job in the calling thread's group while a command runs in it. A null job, or
+    // a thread outside any group, is ignored.
+    class Member {
+    public:
+        explicit Member(SandboxJob* job) : m_group(job ? t_cancellation : nullptr), m_job(job) {
+            if (m_group) {
+                m_group->add(m_job);
+            }
+        }
+        Member(const Member&) = delete;
+        Member& operator=(const Member&) = delete;
+        ~Member() {
+            if (m_group) {
+                m_group->remove(m_job);
+            }
+        }
+
+    private:
+        CancellationGroup* m_group;
+        SandboxJob* m_job;
+    };
+
+    // Whether the calling thread's batch was cancelled
+    static bool currentCancelled() {
+        return t_cancellation && t_cancellation->cancelled();
+    }
+
+    void cancel() {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_cancelled = true;
+        for (SandboxJob* job : m_jobs) {
+            job->cancel();
+        }
+    }
+
+    bool cancelled() const {
+        return m_cancelled;
+    }
+
+private:
+    void add(SandboxJob* job) {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_jobs.insert(job);
+        if (m_cancelled) {
+            job->cancel();
+        }
+    }
+
+    void remove(SandboxJob* job) {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_jobs.erase(job);
+    }
+
+    std::mutex m_mutex;
+    std::set<SandboxJob*> m_jobs;
+    std::atomic<bool> m_cancelled{ false };
+};
+
+// With CODEVALIDATOR_PAUSE_BACKGROUND=1, background program runs are suspended while
+// interactive work runs, and ones that have not started yet wait until it is done. Only
+// validated programs are paused: tool commands may hold locks interactive work needs.
+class BackgroundPause {
+public:
+    static BackgroundPause& instance() {
+        static BackgroundPause pause;
+        return pause;
+    }
+
+    static bool enabled() {
+        static const bool pauseEnabled = readEnvironment(L"CODEVALIDATOR_PAUSE_BACKGROUND") == "1";
+        return pauseEnabled;
+    }
+
+    // Marks interactive work as running for its lifetime
+    class Scope {
+    public:
+        Scope() {
+            if (enabled()) {
+                instance().enter();
+            }
+        }
+        Scope(const Scope&) = delete;
+        Scope& operator=(const Scope&) = delete;
+        ~Scope() {
+            if (enabled()) {
+                instance().leave();
+            }
+        }
+    };
+
+    // Makes a command's job pausable for its lifetime when it runs on behalf of background
+    // work, first waiting out any pause. A null job is ignored. A pause only suspends the
+    // processes already in the job, so startProcess also calls waitToStart once the new
+    // process is in the job and before it is resumed.
+    class Pausable {
+    public:
+        explicit Pausable(SandboxJob* job) {
+            if (job && enabled() && t_priority == Priority::Background) {
+                m_job = job;
+                instance().add(job);
+            }
+        }
+        Pausable(const Pausable&) = delete;
+        Pausable& operator=(const Pausable&) = delete;
+        ~Pausable() {
+            if (m_job) {
+                instance().remove(m_job);
+            }
+        }
+
+    private:
+        SandboxJob* m_job = nullptr;
+    };
+
+    // Holds back a process that is in a pausable job but still suspended until any pause
+    // ends. A pause that starts after this returns finds the process in the job.
+    static void waitToStart(SandboxJob* job) {
+        if (job && enabled()) {
+            instance().waitUntilResumed(job);
+        }
+    }
+
+private:
+    void add(SandboxJob* job) {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        m_resumed.wait(lock, [this] { return m_interactive == 0; });
+        m_jobs.insert(job);
+    }
+
+    void remove(SandboxJob* job) {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_jobs.erase(job);
+    }
+
+    void waitUntilResumed(SandboxJob* job) {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        if (m_jobs.count(job)) {
+            m_resumed.wait(lock, [this] { return m_interactive == 0; });
+        }
+    }
+
+    void enter() {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        if (m_interactive++ == 0) {
+            for (SandboxJob* job : m_jobs) {
+                setSuspended(job, true);
+            }
+        }
+    }
+
+    void leave() {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        if (--m_interactive == 0) {
+            for (SandboxJob* job : m_jobs) {
+                setSuspended(job, false);
+            }
+            m_resumed.notify_all();
+        }
+    }
+
+    // Suspends or resumes every process in a job as a whole, so their threads stay consistent
+    static void setSuspended(SandboxJob* job, bool suspended) {
+        using ProcessCall = LONG(NTAPI*)(HANDLE);
+        static const HMODULE ntdll = GetModuleHandleW(L"ntdll.dll");
+        static const auto suspendProcess = reinterpret_cast<ProcessCall>(GetProcAddress(ntdll, "NtSuspendProcess"));
+        static const auto resumeProcess = reinterpret_cast<ProcessCall>(GetProcAddress(ntdll, "NtResumeProcess"));
+        ProcessCall call = suspended ? suspendProcess : resumeProcess;
+        if (!call) {
+            return;
+        }
+
+        std::vector<ULONG_PTR> buffer(2 + std::max<DWORD>(SandboxLimits::current().activeProcesses, 256));
+        auto* list = reinterpret_cast<JOBOBJECT_BASIC_PROCESS_ID_LIST*>(buffer.data());
+        if (!QueryInformationJobObject(job->handle(), JobObjectBasicProcessIdList, list,
+            static_cast<DWORD>(buffer.size() * sizeof(ULONG_PTR)), nullptr)) {
+            return;
+        }
+        for (DWORD i = 0; i < list->NumberOfProcessIdsInList; ++i) {
+            HandleGuard process(OpenProcess(PROCESS_SUSPEND_RESUME, FALSE, static_cast<DWORD>(list->ProcessIdList[i])), CloseHandle);
+            if (process) {
+                call(process.get());
+            }
+        }
+    }
+
+    std::mutex m_mutex;
+    std::condition_variable m_resumed;
+    std::set<SandboxJob*> m_jobs;
+    size_t m_interactive = 0;
+};
+
+// Our own token with all privileges and administrator rights removed, created once
+HANDLE sandboxToken() {
+    static const HANDLE token = [] {
+        HANDLE processToken = nullptr;
+        HANDLE restricted = nullptr;
+        if (OpenProcessToken(GetCurrentProcess(), TOKEN_DUPLICATE | TOKEN_ASSIGN_PRIMARY | TOKEN_QUERY | TOKEN_ADJUST_DEFAULT, &processToken)) {
+            HandleGuard processTokenGuard(processToken, CloseHandle);
+            if (!CreateRestrictedToken(processToken, DISABLE_MAX_PRIVILEGE | LUA_TOKEN, 0, nullptr, 0, nullptr, 0, nullptr, &restricted)) {
+                restricted = nullptr;
+            }
+        }
+        return restricted;
+    }();
+    return token;
+}
+
+// Starts a process inside a job, or directly when the job is null. The process is created
+// suspended and only resumed once it is in the job, so it cannot start children outside it.
+bool startProcess(const std::string& commandLine, DWORD flags, STARTUPINFOW& startupInfo, SandboxJob* job, PROCESS_INFORMATION& processInfo) {
+    if (CancellationGroup::currentCancelled()) {
+        return false;
+    }
+    std::wstring command = toWide(commandLine);
+    HANDLE token = job ? sandboxToken() : nullptr;
+    BOOL created = token
+        ? CreateProcessAsUserW(token, nullptr, command.data(), nullptr, nullptr, TRUE, flags | CREATE_SUSPENDED, nullptr, nullptr, &startupInfo, &processInfo)
+        : CreateProcessW(nullptr, command.data(), nullptr, nullptr, TRUE, flags | CREATE_SUSPENDED, nullptr, nullptr, &startupInfo, &processInfo);
+    if (!created) {
+        return false;
+    }
+    // A cancel that came in while the process was being created found its job still empty
+    if ((job && !AssignProcessToJobObject(job->handle(), processInfo.hProcess)) || CancellationGroup::currentCancelled()) {
+        TerminateProcess(processInfo.hProcess, 1);
+        CloseHandle(processInfo.hThread);
+        CloseHandle(processInfo.hProcess);
+        return false;
+    }
+    BackgroundPause::waitToStart(job);
+    ResumeThread(processInfo.hThread);
+    CloseHandle(processInfo.hThread);
+    processInfo.hThread = nullptr;
+    return true;
+}
+
+// Sandbox jobs created ahead of time and reused, so sandboxing adds no setup to a spawn.
+// A released job is emptied first, killing anything a command left running.
+class SandboxSlots {
+public:
+    // Job for one command, handed back to the pool when the lease ends
+    class Lease {
+    public:
+        explicit Lease(std::unique_ptr<SandboxJob> job) : m_job(std::move(job)) {}
+        Lease(const Lease&) = delete;
+        Lease& operator=(const Lease&) = delete;
+        ~Lease() {
+            SandboxSlots::instance().release(std::move(m_job));
+        }
+
+        // Null when sandboxing is off
+        SandboxJob* job() const {
+            return m_job.get();
+        }
+
+    private:
+        std::unique_ptr<SandboxJob> m_job;
+    };
+
+    static SandboxSlots& instance() {
+        static SandboxSlots slots(std::max(4u, std::thread::hardware_concurrency() * 2));
+        return slots;
+    }
+
+    explicit SandboxSlots(size_t count) {
+        for (size_t i = 0; i < count; ++i) {
+            auto job = SandboxJob::create();
+            if (!job) {
+                break;
+            }
+            m_free.push_back(std::move(job));
+        }
+    }
+
+    // Grows the pool when every slot is in use
+    std::unique_ptr<Lease> acquire() {
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            if (!m_free.empty()) {
+                auto job = std::move(m_free.back());
+                m_free.pop_back();
+                return std::make_unique<Lease>(std::move(job));
+            }
+        }
+        return std::make_unique<Lease>(SandboxJob::create());
+    }
+
+private:
+    void release(std::unique_ptr<SandboxJob> job) {
+        if (!job) {
+            return;
+        }
+        job->reset();
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_free.push_back(std::move(job));
+    }
+
+    std::mutex m_mutex;
+    std::vector<std::unique_ptr<SandboxJob>> m_free;
+};
+
+// Child process with a writable stdin pipe and stdout/stderr merged into one readable pipe
+class ChildProcess {
+public:
+    ChildProcess() = default;
+    ChildProcess(const ChildProcess&) = delete;
+    ChildProcess& operator=(const ChildProcess&) = delete;
+
+    ~ChildProcess() {
+        closeInput();
+        if (m_output) {
+            CloseHandle(m_output);
+        }
+        if (m_process) {
+            if (WaitForSingleObject(m_process, 0) == WAIT_TIMEOUT) {
+                TerminateProcess(m_process, 1);
+            }
+            CloseHandle(m_process);
+        }
+    }
+
+    // With discardErrors the child's stderr goes to NUL instead of being merged into its
+    // output, for children whose output is parsed
+    bool start(const std::string& commandLine, bool discardErrors = false) {
+        SECURITY_ATTRIBUTES inheritable{ sizeof(SECURITY_ATTRIBUTES), nullptr, TRUE };
+        HandleGuard nul(nullptr, CloseHandle);
+        if (discardErrors) {
+            nul.reset(CreateFileW(L"NUL", GENERIC_WRITE, FILE_SHARE_READ | FILE_SHARE_WRITE, &inheritable, OPEN_EXISTING, 0, nullptr));
+            if (nul.get() == INVALID_HANDLE_VALUE) {
+                nul.release();
+                return false;
+            }
+        }
+        HANDLE childInput = nullptr;
+        HANDLE childOutput = nullptr;
+        if (!CreatePipe(&childInput, &m_input, &inheritable, 0)) {
+            return false;
+        }
+        if (!CreatePipe(&m_output, &childOutput, &inheritable, 0)) {
+            CloseHandle(childInput);
+            return false;
+        }
+        HandleGuard inputGuard(childInput, CloseHandle);
+        HandleGuard outputGuard(childOutput, CloseHandle);
+        SetHandleInformation(m_input, HANDLE_FLAG_INHERIT, 0);
+        SetHandleInformation(m_output, HANDLE_FLAG_INHERIT, 0);
+
+        // Only the two pipe ends (and NUL) may be inherited, so concurrent spawns on other
+        // threads cannot leak their handles into this child and hold its pipes open.
+        SIZE_T attributeSize = 0;
+        InitializeProcThreadAttributeList(nullptr, 1, 0, &attributeSize);
+        std::vector<char> attributeBuffer(attributeSize);
+        auto attributes = reinterpret_cast<LPPROC_THREAD_ATTRIBUTE_LIST>(attributeBuffer.data());
+        if (!InitializeProcThreadAttributeList(attributes, 1, 0, &attributeSize)) {
+            return false;
+        }
+        std::vector<HANDLE> inherited = { childInput, childOutput };
+        if (nul) {
+            inherited.push_back(nul.get());
+        }
+        UpdateProcThreadAttribute(attributes, 0, PROC_THREAD_ATTRIBUTE_HANDLE_LIST, inherited.data(), inherited.size() * sizeof(HANDLE), nullptr, nullptr);
+
+        STARTUPINFOEXW startupInfo{};
+        startupInfo.StartupInfo.cb = sizeof(startupInfo);
+        startupInfo.StartupInfo.dwFlags = STARTF_USESTDHANDLES;
+        startupInfo.StartupInfo.hStdInput = childInput;
+        startupInfo.StartupInfo.hStdOutput = childOutput;
+        startupInfo.StartupInfo.hStdError = nul ? nul.get() : childOutput;
+        startupInfo.lpAttributeList = attributes;
+
+        // Started ahead of time, so each child gets a sandbox job of its own
+        m_job = SandboxJob::create();
+        PROCESS_INFORMATION processInfo{};
+        bool created = startProcess(commandLine, CREATE_NO_WINDOW | EXTENDED_STARTUPINFO_PRESENT, startupInfo.StartupInfo, m_job.get(), processInfo);
+        DeleteProcThreadAttributeList(attributes);
+        if (!created) {
+            return false;
+        }
+
+        m_process = processInfo.hProcess;
+        return true;
+    }
+
+    bool writeInput(std::string_view data) {
+        DWORD written = 0;
+        return m_input && WriteFile(m_input, data.data(), static_cast<DWORD>(data.size()), &written, nullptr) && written == data.size();
+    }
+
+    // Null when sandboxing is off
+    SandboxJob* job() const {
+        return m_job.get();
+    }
+
+    // Sets the memory ceiling in MB for this child's job; 0 selects the sandbox default
+    void setMemoryLimit(uintmax_t megabytes) {
+        if (m_job) {
+            m_job->setMemoryLimit(megabytes);
+        }
+    }
+
+    void closeInput() {
+        if (m_input) {
+            CloseHandle(m_input);
+            m_input = nullptr;
+        }
+    }
+
+    // Appends the output available now, waiting until there is some; false once the child
+    // has closed it
+    bool readSome(std::string& output) {
+        std::array<char, 64 * 1024> buffer{};
+        DWORD bytesRead = 0;
+        if (!ReadFile(m_output, buffer.data(), static_cast<DWORD>(buffer.size()), &bytesRead, nullptr) || bytesRead == 0) {
+            return false;
+        }
+        output.append(buffer.data(), bytesRead);
+        return true;
+    }
+
+    // Reads merged stdout/stderr until the child closes it, then waits for exit
+    std::string readOutput() {
+        std::array<char, 4096> buffer{};
+        std::string result;
+        DWORD bytesRead = 0;
+        while (ReadFile(m_output, buffer.data(), static_cast<DWORD>(buffer.size()), &bytesRead, nullptr) && bytesRead > 0) {
+            result.append(buffer.data(), bytesRead);
+        }
+        WaitForSingleObject(m_process, INFINITE);
+        appendKillReason(m_job.get(), result);
+        return result;
+    }
+
+    // Exit code once readOutput has returned
+    DWORD exitCode() const {
+        DWORD code = 1;
+        GetExitCodeProcess(m_process, &code);
+        return code;
+    }
+
+private:
+    HANDLE m_process = nullptr;
+    std::unique_ptr<SandboxJob> m_job;
+    HANDLE m_input = nullptr;
+    HANDLE m_output = nullptr;
+};
+
+constexpr uintmax_t DEFAULT_ADMIT_FREE_MEMORY_PERCENT = 10;
+constexpr uintmax_t DEFAULT_ADMIT_RUN_QUEUE = 2;
+
+// Holds back commands started for background work while the machine is short of memory or
+// processors, so a batch does not push it into paging or leave threads waiting to run. A
+// command is admitted when available physical memory is at least
+// CODEVALIDATOR_ADMIT_FREE_MEMORY_PERCENT of the total (10) and the processor queue, the
+// threads that are ready but waiting for a processor, averages fewer than
+// CODEVALIDATOR_ADMIT_RUN_QUEUE per processor (2). Busy processors alone are not pressure: a
+// batch running one command per processor keeps every one busy with nothing waiting. Either
+// variable set to 0 turns that check off. Commands are only delayed, never failed, and one
+// is always admitted when none of ours are running, since nothing we run would free
+// anything up.
+class AdmissionControl {
+public:
+    static AdmissionControl& instance() {
+        static AdmissionControl control;
+        return control;
+    }
+
+    // Counts a running command for its lifetime, waiting first for headroom if needed. A
+    // ticket taken while the thread already holds one, such as for a command run to set up
+    // a warm run, is admitted with the outer one: waiting there could never end, since the
+    // outer ticket keeps the machine from looking idle.
+    class Ticket {
+    public:
+        Ticket() : m_outermost(t_held++ == 0) {
+            if (m_outermost) {
+                instance().admit();
+            }
+        }
+        Ticket(const Ticket&) = delete;
+        Ticket& operator=(const Ticket&) = delete;
+        ~Ticket() {
+            if (m_outermost) {
+                instance().m_running--;
+            }
+            t_held--;
+        }
+
+    private:
+        bool m_outermost;
+    };
+
+    // For processes only worth starting with headroom to spare, such as spare interpreters:
+    // reports whether there is headroom now instead of waiting for it
+    static bool hasHeadroomNow() {
+        AdmissionControl& control = instance();
+        std::lock_guard<std::mutex> lock(control.m_mutex);
+        return control.hasHeadroom();
+    }
+
+private:
+    AdmissionControl() {
+        m_minFreePercent = readEnvironmentNumber(L"CODEVALIDATOR_ADMIT_FREE_MEMORY_PERCENT", DEFAULT_ADMIT_FREE_MEMORY_PERCENT);
+        m_maxRunQueue = readEnvironmentNumber(L"CODEVALIDATOR_ADMIT_RUN_QUEUE", DEFAULT_ADMIT_RUN_QUEUE);
+        m_processors = std::max(1u, std::thread::hardware_concurrency());
+        if (m_maxRunQueue > 0 && (PdhOpenQueryW(nullptr, 0, &m_query) != ERROR_SUCCESS
+            || PdhAddEnglishCounterW(m_query, L"\\System\\Processor Queue Length", 0, &m_counter) != ERROR_SUCCESS)) {
+            m_counter = nullptr;
+        }
+    }
+
+    ~AdmissionControl() {
+        if (m_query) {
+            PdhCloseQuery(m_query);
+        }
+    }
+
+    void admit() {
+        if (t_priority == Priority::Interactive) {
+            m_running++;
+            return;
+        }
+        for (;;) {
+            {
+                std::lock_guard<std::mutex> lock(m_mutex);
+                if (m_running == 0 || hasHeadroom()) {
+                    m_running++;
+                    return;
+                }
+            }
+            std::this_thread::sleep_for(std::chrono::milliseconds(100));
+        }
+    }
+
+    // Samples are taken at most every 250 ms and shared by all waiting threads
+    bool hasHeadroom() {
+        auto now = std::chrono::steady_clock::now();
+        if (now - m_sampled >= std::chrono::milliseconds(250)) {
+            m_sampled = now;
+            sample();
+        }
+        return m_memoryOk && m_processorsOk;
+    }
+
+    void sample() {
+        MEMORYSTATUSEX memory{};
+        memory.dwLength = sizeof(memory);
+        m_memoryOk = m_minFreePercent == 0 || !GlobalMemoryStatusEx(&memory)
+            || memory.ullAvailPhys * 100 >= memory.ullTotalPhys * m_minFreePercent;
+
+        PDH_FMT_COUNTERVALUE value{};
+        if (!m_counter || PdhCollectQueryData(m_query) != ERROR_SUCCESS
+            || PdhGetFormattedCounterValue(m_counter, PDH_FMT_LONG, nullptr, &value) != ERROR_SUCCESS) {
+            m_processorsOk = true;
+            return;
+        }
+        // The queue length is a count at the moment of sampling, so it is averaged over the
+        // last few samples to keep one burst of wake-ups from holding work back
+        m_runQueue = (m_runQueue + std::max<LONG>(value.longValue, 0)) / 2;
+        m_processorsOk = m_runQueue < static_cast<double>(m_maxRunQueue * m_processors);
+    }
+
+    std::mutex m_mutex;
+    std::atomic<size_t> m_running{ 0 };
+    uintmax_t m_minFreePercent = 0;
+    uintmax_t m_maxRunQueue = 0;
+    unsigned m_processors = 1;
+    PDH_HQUERY m_query = nullptr;
+    PDH_HCOUNTER m_counter = nullptr;
+    std::chrono::steady_clock::time_point m_sampled;
+    bool m_memoryOk = true;
+    bool m_processorsOk = true;
+    double m_runQueue = 0;
+
+    static thread_local size_t t_held;
+};
+
+thread_local size_t AdmissionControl::t_held = 0;
+
+// Interpreters started ahead of time with their common modules already imported.
+// Each one runs a single job and exits, so jobs never share interpreter state,
+// but the startup cost is paid while the previous job is still running.
+class WarmInterpreterPool {
+public:
+    WarmInterpreterPool(std::string commandLine, size_t spareCount)
+        : m_commandLine(std::move(commandLine)), m_spareCount(spareCount) {}
+
+    // Process-wide pool for a worker command line, created on first use
+    static WarmInterpreterPool& forCommand(const std::string& commandLine) {
+        static std::mutex poolsMutex;
+        static std::map<std::string, std::unique_ptr<WarmInterpreterPool>> pools;
+        std::lock_guard<std::mutex> lock(poolsMutex);
+        auto& pool = pools[commandLine];
+        if (!pool) {
+            pool = std::make_unique<WarmInterpreterPool>(commandLine, 2);
+        }
+        return *pool;
+    }
+
+    std::unique_ptr<ChildProcess> acquire() {
+        std::unique_ptr<ChildProcess> child;
+        {
+            // The last spare is kept for interactive work
+            std::lock_guard<std::mutex> lock(m_mutex);
+            if (m_spares.size() > (t_priority == Priority::Background ? 1u : 0u)) {
+                child = std::move(m_spares.front());
+                m_spares.pop_front();
+            }
+        }
+        if (!child) {
+            child = spawn();
+        }
+        if (child) {
+            refill();
+        }
+        return child;
+    }
+
+private:
+    std::unique_ptr<ChildProcess> spawn() {
+        auto child = std::make_unique<ChildProcess>();
+        return child->start(m_commandLine) ? std::move(child) : nullptr;
+    }
+
+    // Spares are only started while admission control sees headroom; when it does not, the
+    // next acquire starts its interpreter itself
+    void refill() {
+        for (;;) {
+            {
+                std::lock_guard<std::mutex> lock(m_mutex);
+                if (m_spares.size() >= m_spareCount) {
+                    return;
+                }
+            }
+            if (!AdmissionControl::hasHeadroomNow()) {
+                return;
+            }
+            auto child = spawn();
+            if (!child) {
+                return;
+            }
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_spares.push_back(std::move(child));
+        }
+    }
+
+    std::string m_commandLine;
+    size_t m_spareCount;
+    std::mutex m_mutex;
+    std::deque<std::unique_ptr<ChildProcess>> m_spares;
+};
+
+// Compares a program's output with an expected-output file as the output arrives, reading
+// the file incrementally. Carriage returns are ignored on both sides and a missing or extra
+// final newline is tolerated.
+class OutputComparer {
+public:
+    bool open(const std::filesystem::path& expectedPath) {
+        m_expected.open(expectedPath, std::ios::binary);
+        return m_expected.is_open();
+    }
+
+    bool matched() const {
+        return m_mismatch.empty();
+    }
+
+    // Where the output first diverged, empty while it matches
+    const std::string& mismatch() const {
+        return m_mismatch;
+    }
+
+    // Compares the next chunk of output; returns false once the output has diverged
+    bool feed(std::string_view chunk) {
+        for (size_t i = 0; i < chunk.size() && matched(); ++i) {
+            char actual = chunk[i];
+            if (actual == '\r') {
+                continue;
+            }
+            if (m_extraNewline) {
+                fail("", chunk.substr(i));
+                break;
+            }
+
+            int expected = nextExpected();
+            if (expected == EOF && actual == '\n') {
+                m_extraNewline = true;
+                advance(actual);
+            }
+            else if (expected != actual) {
+                fail(expected == EOF ? "" : std::string(1, static_cast<char>(expected)), chunk.substr(i));
+            }
+            else {
+                advance(actual);
+            }
+        }
+        return matched();
+    }
+
+    // Called when the output ends; returns false when expected output is left over
+    bool finish() {
+        if (matched()) {
+            int expected = nextExpected();
+            if (expected == '\n') {
+                advance('\n');
+                expected = nextExpected();
+            }
+            if (expected != EOF) {
+                fail(std::string(1, static_cast<char>(expected)), "");
+            }
+        }
+        return matched();
+    }
+
+private:
+    int nextExpected() {
+        int c = m_expected.get();
+        while (c == '\r') {
+            c = m_expected.get();
+        }
+        return c;
+    }
+
+    void advance(char c) {
+        m_offset++;
+        if (c == '\n') {
+            m_line++;
+            m_column = 1;
+            m_currentLine.clear();
+            return;
+        }
+        m_column++;
+        if (m_currentLine.size() < MAX_REPORTED_LINE) {
+            m_currentLine += c;
+        }
+    }
+
+    // Records the divergence with both versions of the line it happened on
+    void fail(const std::string& expectedRest, std::string_view actualRest) {
+        std::string expectedLine = m_currentLine + expectedRest;
+        if (expectedRest != "\n") {
+            std::string rest;
+            std::getline(m_expected, rest);
+            expectedLine += rest;
+        }
+        std::string actualLine = m_currentLine + std::string(actualRest.substr(0, actualRest.find('\n')));
+
+        auto clean = [](std::string line) {
+            line.erase(std::remove(line.begin(), line.end(), '\r'), line.end());
+            if (!line.empty() && line.back() == '\n') {
+                line.pop_back();
+            }
+            return line.size() > MAX_REPORTED_LINE ? line.substr(0, MAX_REPORTED_LINE) + "..." : line;
+        };
+        m_mismatch = "Output differs from the expected output at line " + std::to_string(m_line)
+            + ", byte " + std::to_string(m_column) + " (offset " + std::to_string(m_offset) + ")"
+            + (expectedRest.empty() ? "; the expected output ends here" : "")
+            + (actualRest.empty() ? "; the program output ends here" : "")
+            + "\nExpected: " + clean(expectedLine) + "\nActual:   " + clean(actualLine);
+    }
+
+    static constexpr size_t MAX_REPORTED_LINE = 200;
+
+    std::ifstream m_expected;
+    uint64_t m_line = 1;
+    uint64_t m_column = 1;
+    uint64_t m_offset = 0;
+    std::string m_currentLine;
+    bool m_extraNewline = false;
+    std::string m_mismatch;
+};
+
+// Settings for one runShellCommand call
+struct CommandOptions {
+    // Memory ceiling in MB for the command and everything it starts; 0 selects the sandbox default
+    uintmax_t memoryLimitMB = 0;
+    // Checks stdout as it streams; the command is killed at the first difference, and its
+    // stderr goes to a temporary file that is appended after the output
+    OutputComparer* comparer = nullptr;
+    // Becomes the command's stdin handle, so the child reads it straight from the file
+    // system cache and none of it passes through the validator
+    std::string inputPath;
+    // Receives the command's exit code
+    DWORD* exitCode = nullptr;
+    // A validated program rather than a tool, which background pauses may suspend
+    bool pausable = false;
+};
+
+// Runs a command through the shell in a sandbox slot and captures its output
+std::string runShellCommand(const std::string& command, const CommandOptions& options = {}) {
+    OutputComparer* comparer = options.comparer;
+    const std::string& inputPath = options.inputPath;
+    SECURITY_ATTRIBUTES inheritable{ sizeof(SECURITY_ATTRIBUTES), nullptr, TRUE };
+    HANDLE readEnd = nullptr;
+    HANDLE writeEnd = nullptr;
+    if (!CreatePipe(&readEnd, &writeEnd, &inheritable, 0)) {
+        return "Error executing command: " + command;
+    }
+    HandleGuard output(readEnd, CloseHandle);
+    HandleGuard childOutput(writeEnd, CloseHandle);
+    SetHandleInformation(readEnd, HANDLE_FLAG_INHERIT, 0);
+
+    // Like the console-less children _popen used to start, commands get no stdin and
+    // their stderr is dropped unless they redirect it with 2>&1
+    HandleGuard nul(CreateFileW(L"NUL", GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ | FILE_SHARE_WRITE,
+        &inheritable, OPEN_EXISTING, 0, nullptr), CloseHandle);
+    if (nul.get() == INVALID_HANDLE_VALUE) {
+        nul.release();
+        return "Error executing command: " + command;
+    }
+    HandleGuard input(nullptr, CloseHandle);
+    if (!inputPath.empty()) {
+        input.reset(CreateFileW(toWide(inputPath).c_str(), GENERIC_READ, FILE_SHARE_READ,
+            &inheritable, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, nullptr));
+        if (input.get() == INVALID_HANDLE_VALUE) {
+            input.release();
+            return "Cannot open input file: " + inputPath;
+        }
+    }
+    HandleGuard errors(nullptr, CloseHandle);
+    if (comparer) {
+        static std::atomic<unsigned> nextFile{ 0 };
+        std::filesystem::path directory = appDataDirectory() / "tmp";
+        std::error_code ec;
+        std::filesystem::create_directories(directory, ec);
+        std::filesystem::path errorsPath = directory / ("stderr-" + std::to_string(GetCurrentProcessId()) + "-" + std::to_string(nextFile++) + ".txt");
+        errors.reset(CreateFileW(errorsPath.wstring().c_str(), GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
+            &inheritable, CREATE_ALWAYS, FILE_ATTRIBUTE_TEMPORARY | FILE_FLAG_DELETE_ON_CLOSE, nullptr));
+        if (errors.get() == INVALID_HANDLE_VALUE) {
+            errors.release();
+            return "Error executing command: " + command;
+        }
+    }
+
+    SIZE_T attributeSize = 0;
+    InitializeProcThreadAttributeList(nullptr, 1, 0, &attributeSize);
+    std::vector<char> attributeBuffer(attributeSize);
+    auto attributes = reinterpret_cast<LPPROC_THREAD_ATTRIBUTE_LIST>(attributeBuffer.data());
+    if (!InitializeProcThreadAttributeList(attributes, 1, 0, &attributeSize)) {
+        return "Error executing command: " + command;
+    }
+    std::vector<HANDLE> inherited = { childOutput.get(), nul.get() };
+    if (errors) {
+        inherited.push_back(errors.get());
+    }
+    if (input) {
+        inherited.push_back(input.get());
+    }
+    UpdateProcThreadAttribute(attributes, 0, PROC_THREAD_ATTRIBUTE_HANDLE_LIST, inherited.data(), inherited.size() * sizeof(HANDLE), nullptr, nullptr);
+
+    STARTUPINFOEXW startupInfo{};
+    startupInfo.StartupInfo.cb = sizeof(startupInfo);
+    startupInfo.StartupInfo.dwFlags = STARTF_USESTDHANDLES;
+    startupInfo.StartupInfo.hStdInput = input ? input.get() : nul.get();
+    startupInfo.StartupInfo.hStdOutput = childOutput.get();
+    startupInfo.StartupInfo.hStdError = errors ? errors.get() : nul.get();
+    startupInfo.lpAttributeList = attributes;
+
+    AdmissionControl::Ticket admission;
+    auto slot = SandboxSlots::instance().acquire();
+    if (slot->job()) {
+        slot->job()->setMemoryLimit(options.memoryLimitMB);
+    }
+    CancellationGroup::Member member(slot->job());
+    BackgroundPause::Pausable pausable(options.pausable ? slot->job() : nullptr);
+    std::string shell = readEnvironment(L"ComSpec", "cmd.exe");
+    PROCESS_INFORMATION processInfo{};
+    bool created = startProcess(quoteArgument(shell) + " /d /s /c \"" + command + "\"",
+        CREATE_NO_WINDOW | EXTENDED_STARTUPINFO_PRESENT, startupInfo.StartupInfo, slot->job(), processInfo);
+    DeleteProcThreadAttributeList(attributes);
+    if (!created) {
+        return "Error executing command: " + command;
+    }
+    HandleGuard process(processInfo.hProcess, CloseHandle);
+    childOutput.reset();
+
+    std::array<char, 4096> buffer{};
+    std::string result;
+    DWORD bytesRead = 0;
+    while (ReadFile(output.get(), buffer.data(), static_cast<DWORD>(buffer.size()), &bytesRead, nullptr) && bytesRead > 0) {
+        result.append(buffer.data(), bytesRead);
+        if (comparer && !comparer->feed(std::string_view(buffer.data(), bytesRead))) {
+            // Wrong output: stop the program instead of letting it run to completion
+            if (slot->job()) {
+                TerminateJobObject(slot->job()->handle(), 1);
+            }
+            else {
+                TerminateProcess(process.get(), 1);
+            }
+            output.reset();
+            break;
+        }
+    }
+    WaitForSingleObject(process.get(), INFINITE);
+    if (options.exitCode && !GetExitCodeProcess(process.get(), options.exitCode)) {
+        *options.exitCode = 1;
+    }
+    if (comparer && comparer->matched()) {
+        comparer->finish();
+    }
+
+    // Text-mode output, as _popen returned it
+    std::string text;
+    text.reserve(result.size());
+    for (size_t i = 0; i < result.size(); ++i) {
+        if (result[i] != '\r' || i + 1 == result.size() || result[i + 1] != '\n') {
+            text += result[i];
+        }
+    }
+
+    if (errors) {
+        std::string errorText;
+        LARGE_INTEGER start{};
+        SetFilePointerEx(errors.get(), start, nullptr, FILE_BEGIN);
+        while (ReadFile(errors.get(), buffer.data(), static_cast<DWORD>(buffer.size()), &bytesRead, nullptr) && bytesRead > 0) {
+            errorText.append(buffer.data(), bytesRead);
+        }
+        errorText.erase(std::remove(errorText.begin(), errorText.end(), '\r'), errorText.end());
+        if (!errorText.empty()) {
+            if (!text.empty() && text.back() != '\n') {
+                text += '\n';
+            }
+            text += "Standard error:\n" + errorText;
+        }
+    }
+    appendKillReason(slot->job(), text);
+    return text;
+}
+
+uint64_t fnv1a64(std::string_view data, uint64_t hash = 14695981039346656037ull) {
+    for (unsigned char c : data) {
+        hash ^= c;
+        hash *= 1099511628211ull;
+    }
+    return hash;
+}
+
+std::string toHex(uint64_t value) {
+    char text[17];
+    snprintf(text, sizeof(text), "%016llx", static_cast<unsigned long long>(value));
+    return text;
+}
+
+// Locates the JDK on PATH and keeps class data sharing archives for javac and the runtime.
+// The archives are built in the background on first use and rebuilt when the JDK changes;
+// until they exist the flag helpers return nothing and launches behave as before.
+class JavaToolchain {
+public:
+    static JavaToolchain& instance() {
+        static JavaToolchain toolchain;
+        return toolchain;
+    }
+
+    // Identifies the installed JDK by its home directory, version and runtime image
+    const std::string& fingerprint() {
+        std::call_once(m_fingerprintOnce, [this] {
+            std::string settings = runShellCommand("java -XshowSettings:properties -version 2>&1");
+            std::string home = readSetting(settings, "java.home");
+            std::string version = readSetting(settings, "java.vm.version");
+            if (home.empty()) {
+                return;
+            }
+
+            std::error_code ec;
+            std::filesystem::path modules = std::filesystem::path(home) / "lib" / "modules";
+            auto size = std::filesystem::file_size(modules, ec);
+            auto modified = std::filesystem::last_write_time(modules, ec).time_since_epoch().count();
+            m_fingerprint = toHex(fnv1a64(home + "|" + version + "|" + std::to_string(size) + "|" + std::to_string(modified)));
+        });
+        return m_fingerprint;
+    }
+
+    std::string javacFlags() {
+        startArchiveBuild();
+        return m_archivesReady ? "-J-Xshare:auto -J-Xlog:disable -J-XX:SharedArchiveFile=" + quoteArgument(m_javacArchive) + " " : "";
+    }
+
+    std::string javaFlags() {
+        startArchiveBuild();
+        return m_archivesReady ? "-Xshare:auto -Xlog:disable -XX:SharedArchiveFile=" + quoteArgument(m_javaArchive) + " " : "";
+    }
+
+    // Blocks until the archives are built or have failed to build
+    bool waitForArchives() {
+        startArchiveBuild();
+        std::unique_lock<std::mutex> lock(m_mutex);
+        m_buildDone.wait(lock, [this] { return m_buildFinished; });
+        return m_archivesReady;
+    }
+
+    std::filesystem::path trainingDirectory() {
+        return archiveDirectory() / "train";
+    }
+
+private:
+    JavaToolchain() = default;
+
+    static std::string readSetting(const std::string& settings, const std::string& name) {
+        std::stringstream stream(settings);
+        std::string line;
+        while (std::getline(stream, line)) {
+            size_t start = line.find_first_not_of(" \t");
+            if (start != std::string::npos && line.compare(start, name.size() + 3, name + " = ") == 0) {
+                std::string value = line.substr(start + name.size() + 3);
+                return value.substr(0, value.find_last_not_of(" \r") + 1);
+            }
+        }
+        return "";
+    }
+
+    std::filesystem::path archiveDirectory() {
+        return appDataDirectory() / "cds" / fingerprint();
+    }
+
+    void startArchiveBuild() {
+        std::call_once(m_buildOnce, [this] {
+            std::thread([this] {
+                bool ready = buildArchives();
+                std::lock_guard<std::mutex> lock(m_mutex);
+                m_archivesReady = ready;
+                m_buildFinished = true;
+                m_buildDone.notify_all();
+            }).detach();
+        });
+    }
+
+    // Records the classes javac and a small program load, then dumps one static archive
+    // per class list. Static archives record no application class path, so they stay
+    // valid whatever directory the validated program runs from.
+    bool buildArchives() {
+        if (fingerprint().empty()) {
+            return false;
+        }
+
+        std::filesystem::path directory = archiveDirectory();
+        std::filesystem::path javacArchive = directory / "javac.jsa";
+        std::filesystem::path javaArchive = directory / "java.jsa";
+        m_javacArchive = toUtf8(javacArchive.wstring());
+        m_javaArchive = toUtf8(javaArchive.wstring());
+
+        std::error_code ec;
+        if (!std::filesystem::exists(javacArchive) || !std::filesystem::exists(javaArchive)) {
+            // Archives of earlier JDKs are never used again
+            for (const auto& entry : std::filesystem::directory_iterator(directory.parent_path(), ec)) {
+                if (entry.path() != directory) {
+                    std::filesystem::remove_all(entry.path(), ec);
+                }
+            }
+
+            std::filesystem::path train = trainingDirectory();
+            std::filesystem::create_directories(train, ec);
+            writeFileIfChanged(train / "Hello.java", JAVA_TRAINING_PROGRAM);
+
+            std::string trainPath = quoteArgument(toUtf8(train.wstring()));
+            std::string javacList = quoteArgument(toUtf8((directory / "javac.classlist").wstring()));
+            std::string javaList = quoteArgument(toUtf8((directory / "java.classlist").wstring()));
+            runShellCommand("javac -J-XX:DumpLoadedClassList=" + javacList + " -d " + trainPath + " "
+                + quoteArgument(toUtf8((train / "Hello.java").wstring())) + " 2>&1");
+            runShellCommand("java -XX:DumpLoadedClassList=" + javaList + " -cp " + trainPath + " Hello 2>&1");
+            runShellCommand("java -Xshare:dump -XX:SharedClassListFile=" + javacList
+                + " -XX:SharedArchiveFile=" + quoteArgument(m_javacArchive) + " 2>&1");
+            runShellCommand("java -Xshare:dump -XX:SharedClassListFile=" + javaList
+                + " -XX:SharedArchiveFile=" + quoteArgument(m_javaArchive) + " 2>&1");
+        }
+        return std::filesystem::exists(javacArchive) && std::filesystem::exists(javaArchive);
+    }
+
+    static constexpr char JAVA_TRAINING_PROGRAM[] = R"(import java.util.*;
+
+public class Hello {
+    public static void main(String[] args) {
+        List<Integer> values = new ArrayList<>();
+        Map<String, Integer> counts = new HashMap<>();
+        Scanner scanner = new Scanner("1 2 3");
+        while (scanner.hasNextInt()) {
+            values.add(scanner.nextInt());
+        }
+        counts.put("sum", values.stream().mapToInt(Integer::intValue).sum());
+        System.out.println(String.format("%s %d", counts, values.size()));
+    }
+}
+)";
+
+    std::once_flag m_fingerprintOnce;
+    std::once_flag m_buildOnce;
+    std::string m_fingerprint;
+    std::string m_javacArchive;
+    std::string m_javaArchive;
+    std::mutex m_mutex;
+    std::condition_variable m_buildDone;
+    bool m_buildFinished = false;
+    std::atomic<bool> m_archivesReady = false;
+};
+
+// Identifies an executable on PATH by its resolved location, size and timestamp
+std::string executableFingerprint(const std::string& name) {
+    wchar_t resolved[MAX_PATH];
+    if (!SearchPathW(nullptr, toWide(name).c_str(), L".exe", MAX_PATH, resolved, nullptr)) {
+        return "";
+    }
+    std::error_code ec;
+    auto size = std::filesystem::file_size(resolved, ec);
+    auto modified = std::filesystem::last_write_time(resolved, ec).time_since_epoch().count();
+    return toHex(fnv1a64(toUtf8(resolved) + "|" + std::to_string(size) + "|" + std::to_string(modified)));
+}
+
+std::string prefixEach(const std::string& flags, const std::string& prefix) {
+    std::stringstream stream(flags);
+    std::string flag;
+    std::string result;
+    while (stream >> flag) {
+        result += prefix + flag + " ";
+    }
+    return result;
+}
+
+// Launch flags per runtime. Candidate flag sets are measured against the installed toolchain
+// and the fastest one that leaves the verdicts of a sample corpus unchanged is kept. The choice
+// is stored per executable fingerprint and measured again in the background when it changes.
+class StartupProfiles {
+public:
+    static StartupProfiles& instance() {
+        static StartupProfiles profiles;
+        return profiles;
+    }
+
+    // Flags to insert right after the runtime's executable name, with a trailing space when non-empty
+    std::string flags(const std::string& runtime) {
+        if (t_override) {
+            auto it = t_override->find(runtime);
+            return it != t_override->end() && !it->second.empty() ? it->second + " " : "";
+        }
+
+        std::string fingerprint = executableFingerprint(runtime);
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            load();
+            auto it = m_profiles.find(runtime);
+            if (it != m_profiles.end() && it->second.fingerprint == fingerprint) {
+                return it->second.flags.empty() ? "" : it->second.flags + " ";
+            }
+        }
+        startBackgroundTuning();
+        return "";
+    }
+
+    // Runtime executable followed by its profile flags, ready to have arguments appended
+    std::string command(const std::string& runtime) {
+        return runtime + " " + flags(runtime);
+    }
+
+    // True on a thread that is currently validating the corpus with candidate flags
+    static bool isTuning() {
+        return t_override != nullptr;
+    }
+
+    // Measures every runtime, stores the winners and returns one report line per runtime
+    std::vector<std::string> tune();
+
+private:
+    struct Profile {
+        std::string fingerprint;
+        std::string flags;
+    };
+
+    StartupProfiles() = default;
+
+    std::filesystem::path storePath() {
+        return appDataDirectory() / "startup_profiles.txt";
+    }
+
+    // Stores from before a change to the candidate flags are measured again
+    static constexpr const char* STORE_VERSION = "version\t2";
+
+    void load() {
+        if (m_loaded) {
+            return;
+        }
+        m_loaded = true;
+        std::ifstream store(storePath());
+        std::string line;
+        if (!std::getline(store, line) || line != STORE_VERSION) {
+            return;
+        }
+        while (std::getline(store, line)) {
+            size_t first = line.find('\t');
+            size_t second = line.find('\t', first + 1);
+            if (first != std::string::npos && second != std::string::npos) {
+                m_profiles[line.substr(0, first)] = { line.substr(first + 1, second - first - 1), line.substr(second + 1) };
+            }
+        }
+    }
+
+    void save() {
+        std::ofstream store(storePath(), std::ios::trunc);
+        store << STORE_VERSION << '\n';
+        for (const auto& [runtime, profile] : m_profiles) {
+            store << runtime << '\t' << profile.fingerprint << '\t' << profile.flags << '\n';
+        }
+    }
+
+    void startBackgroundTuning() {
+        std::call_once(m_backgroundOnce, [this] {
+            std::thread([this] { tune(); }).detach();
+        });
+    }
+
+    std::string corpusVerdicts(const std::string& runtime, const std::string& flags, const std::vector<std::filesystem::path>& corpus);
+
+    static thread_local const std::map<std::string, std::string>* t_override;
+
+    std::mutex m_mutex;
+    std::mutex m_tuneMutex;
+    std::once_flag m_backgroundOnce;
+    std::map<std::string, Profile> m_profiles;
+    bool m_loaded = false;
+};
+
+thread_local const std::map<std::string, std::string>* StartupProfiles::t_override = nullptr;
+
+// Cache hit counts kept for the life of the process. With CODEVALIDATOR_TIMING=1
+// validators append their phase timings and cache outcomes to each result.
+class ValidationTimings {
+public:
+    static ValidationTimings& instance() {
+        static ValidationTimings timings;
+        return timings;
+    }
+
+    static bool enabled() {
+        static const bool timingEnabled = readEnvironment(L"CODEVALIDATOR_TIMING") == "1";
+        return timingEnabled;
+    }
+
+    static double millisecondsSince(std::chrono::steady_clock::time_point start) {
+        return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+    }
+
+    void recordCache(const std::string& cache, bool hit) {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        auto& stats = m_caches[cache];
+        stats.lookups++;
+        if (hit) {
+            stats.hits++;
+        }
+    }
+
+    // "3 of 4 hits" for the named cache
+    std::string hitRate(const std::string& cache) {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        const auto& stats = m_caches[cache];
+        return std::to_string(stats.hits) + " of " + std::to_string(stats.lookups) + " hits";
+    }
+
+private:
+    struct CacheStats {
+        size_t hits = 0;
+        size_t lookups = 0;
+    };
+
+    std::mutex m_mutex;
+    std::map<std::string, CacheStats> m_caches;
+};
+
+// Settings for running a validated program, taken from the validation request
+struct RunOptions {
+    // Compare the program's stdout with this file instead of just capturing it
+    std::string expectedOutputPath;
+    // Attach this file to the program's stdin
+    std::string inputPath;
+    // Treat the program as deterministic even without a marker comment
+    bool deterministic = false;
+    // Allow the run phase to be served from the run cache
+    bool useRunCache = true;
+
+    // Warm interpreters read the script path from stdin and merge stderr into stdout,
+    // so runs with their own input or compared output need a fresh process
+    bool allowsWarmStart() const {
+        return expectedOutputPath.empty() && inputPath.empty();
+    }
+};
+
+// Result of a validator's check phase: how to run the program, or why it cannot run
+struct PreparedProgram {
+    std::string sourcePath;
+    std::string failure;
+    std::string runCommand;
+    std::string header = "Compilation successful.\n";
+    // Fingerprint of the runtime that runs the program
+    std::string toolchain;
+    // Where the check phase left compiled output, if it produced any
+    std::filesystem::path buildDirectory;
+};
+
+// Outcome of a program's run phase, without the check phase's header
+struct ProgramRun {
+    std::string output;
+    // Cleared when the output replaces the header, as for a wrong answer
+    bool showHeader = true;
+    bool passed = false;
+    // Cleared when the program could not be started, so the result is not worth keeping
+    bool complete = false;
+};
+
+constexpr uintmax_t RUN_CACHE_LIMIT_MB = 256;
+
+constexpr char DEFAULT_RUN_CACHE_ENVIRONMENT[] = "PATH,PATHEXT,SYSTEMROOT,TZ,LANG,PYTHONPATH,PYTHONHASHSEED,NODE_PATH,NODE_OPTIONS,CLASSPATH,JAVA_TOOL_OPTIONS";
+
+// Run results of programs marked deterministic, kept across processes. An entry is keyed by
+// everything that can change what a run prints: the run command, the contents of the program
+// and the files it loads, the toolchain, stdin, the expected output, the memory ceiling and
+// the environment variables named in CODEVALIDATOR_RUN_CACHE_ENV (comma separated).
+// Disabled with CODEVALIDATOR_RUN_CACHE=0.
+class RunCache {
+public:
+    static RunCache& instance() {
+        static RunCache cache;
+        return cache;
+    }
+
+    // Programs opt in with a "codevalidator: deterministic" comment or the request's
+    // deterministic=1 option; a "codevalidator: nondeterministic" comment opts a file out
+    static bool appliesTo(const std::string& sourcePath, const RunOptions& options) {
+        static const bool enabled = readEnvironment(L"CODEVALIDATOR_RUN_CACHE", "1") != "0";
+        if (!enabled || !options.useRunCache) {
+            return false;
+        }
+        Marker marker = markerOf(sourcePath);
+        return marker == Marker::Deterministic || (marker == Marker::None && options.deterministic);
+    }
+
+    // Empty when the dependencies are unknown (no files) or one of the inputs cannot be read,
+    // which keeps the run out of the cache
+    std::string key(const PreparedProgram& program, const RunOptions& options, const std::set<std::string>& files, uintmax_t memoryLimitMB) {
+        if (files.empty()) {
+            return "";
+        }
+        uint64_t hash = fnv1a64(program.runCommand);
+        hash = fnv1a64("\n" + program.toolchain + "\n" + std::to_string(memoryLimitMB) + "\n", hash);
+        for (const auto& file : files) {
+            hash = fnv1a64(file + "\n", hash);
+            if (!hashFile(file, hash)) {
+                return "";
+            }
+        }
+        for (const std::string* path : { &options.inputPath, &options.expectedOutputPath }) {
+            hash = fnv1a64(path->empty() ? "\n-" : "\n+", hash);
+            if (!path->empty() && !hashFile(*path, hash)) {
+                return "";
+            }
+        }
+        std::stringstream names(readEnvironment(L"CODEVALIDATOR_RUN_CACHE_ENV", DEFAULT_RUN_CACHE_ENVIRONMENT));
+        std::string name;
+        while (std::getline(names, name, ',')) {
+            name = trimString(name);
+            if (!name.empty()) {
+                hash = fnv1a64("\n" + name + "=" + readEnvironment(toWide(name).c_str()), hash);
+            }
+        }
+        return toHex(hash);
+    }
+
+    bool lookup(const std::string& key, ProgramRun& run) {
+        std::ifstream file(m_directory / (key + ".txt"), std::ios::binary);
+        std::string flags;
+        bool hit = file.is_open() && std::getline(file, flags) && flags.size() == 2;
+        if (hit) {
+            run.showHeader = flags[0] == '1';
+            run.passed = flags[1] == '1';
+            run.complete = true;
+            run.output.assign(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+        }
+        ValidationTimings::instance().recordCache("run cache", hit);
+        return hit;
+    }
+
+    // Entries are written under a unique name and renamed into place, so a concurrent
+    // lookup never sees half of one
+    void store(const std::string& key, const ProgramRun& run) {
+        static std::atomic<unsigned> nextFile{ 0 };
+        std::filesystem::path temporary = m_directory / (key + "-" + std::to_string(GetCurrentProcessId()) + "-" + std::to_string(nextFile++) + ".tmp");
+        {
+            std::ofstream file(temporary, std::ios::binary | std::ios::trunc);
+            file << (run.showHeader ? '1' : '0') << (run.passed ? '1' : '0') << '\n' << run.output;
+        }
+        std::error_code ec;
+        std::filesystem::rename(temporary, m_directory / (key + ".txt"), ec);
+        if (ec) {
+            std::filesystem::remove(temporary, ec);
+        }
+    }
+
+private:
+    enum class Marker {
+        None,
+        Deterministic,
+        Nondeterministic
+    };
+
+    // Every case of a multi-case run asks about the same source, so the marker is scanned
+    // once per version of the file, recognised by its size and modification time
+    static Marker markerOf(const std::string& sourcePath) {
+        struct Scanned {
+            uintmax_t size = 0;
+            std::filesystem::file_time_type modified;
+            Marker marker = Marker::None;
+        };
+        static std::mutex scannedMutex;
+        static std::map<std::string, Scanned> scanned;
+
+        std::filesystem::path path(toWide(sourcePath));
+        std::error_code ec;
+        uintmax_t size = std::filesystem::file_size(path, ec);
+        std::filesystem::file_time_type modified = std::filesystem::last_write_time(path, ec);
+        if (!ec) {
+            std::lock_guard<std::mutex> lock(scannedMutex);
+            auto it = scanned.find(sourcePath);
+            if (it != scanned.end() && it->second.size == size && it->second.modified == modified) {
+                return it->second.marker;
+            }
+        }
+
+        static const std::regex pattern(R"(codevalidator:\s*(non)?deterministic\b)", std::regex::icase);
+        std::string source = readFileContents(path);
+        Marker marker = Marker::None;
+        for (std::sregex_iterator it(source.begin(), source.end(), pattern), end; it != end; ++it) {
+            if ((*it)[1].matched) {
+                marker = Marker::Nondeterministic;
+                break;
+            }
+            marker = Marker::Deterministic;
+        }
+        if (!ec) {
+            std::lock_guard<std::mutex> lock(scannedMutex);
+            scanned[sourcePath] = { size, modified, marker };
+        }
+        return marker;
+    }
+
+    RunCache() {
+        m_directory = appDataDirectory() / "runcache";
+        std::error_code ec;
+        std::filesystem::create_directories(m_directory, ec);
+        std::thread(trimDirectory, m_directory, readEnvironmentNumber(L"CODEVALIDATOR_RUN_CACHE_LIMIT_MB", RUN_CACHE_LIMIT_MB) * 1024 * 1024).detach();
+    }
+
+    // Folds a file's contents into the hash, reading it in blocks
+    static bool hashFile(const std::string& path, uint64_t& hash) {
+        std::ifstream file(std::filesystem::path(toWide(path)), std::ios::binary);
+        if (!file.is_open()) {
+            return false;
+        }
+        std::array<char, 65536> buffer{};
+        while (file.read(buffer.data(), buffer.size()) || file.gcount() > 0) {
+            hash = fnv1a64(std::string_view(buffer.data(), static_cast<size_t>(file.gcount())), hash);
+        }
+        return true;
+    }
+
+    std::filesystem::path m_directory;
+};
+
+class LanguageValidator {
+public:
+    virtual ~LanguageValidator() = default;
+    virtual bool isCompatible(const std::string& filePath) = 0;
+
+    // Check phase: compiles or lints the file and leaves behind whatever its run needs
+    virtual PreparedProgram prepare(const std::string& filePath) = 0;
+
+    // Checks the file, then runs it once. `passed` is set only when the check succeeded and
+    // the program ran to a zero exit code with the expected output, if any.
+    virtual std::string validate(const std::string& filePath, const RunOptions& options, bool* passed = nullptr) {
+        if (passed) {
+            *passed = false;
+        }
+        PreparedProgram program = prepare(filePath);
+        if (!program.failure.empty()) {
+            return program.failure;
+        }
+        return runProgram(program, options, passed);
+    }
+
+    // Run phase: runs the validated program and formats its result after the program's
+    // header. Deterministic programs are served from the run cache when nothing the run
+    // depends on changed. `passed` is cleared for a wrong answer and for a non-zero exit
+    // code, which includes limit kills.
+    std::string runProgram(const PreparedProgram& program, const RunOptions& options, bool* passed = nullptr) {
+        RunCache& cache = RunCache::instance();
+        std::string cacheKey;
+        if (RunCache::appliesTo(program.sourcePath, options)) {
+            cacheKey = cache.key(program, options, runDependencies(program), memoryLimitMB());
+        }
+
+        ProgramRun run;
+        if (cacheKey.empty() || !cache.lookup(cacheKey, run)) {
+            run = execute(program, options);
+            // A run cut short by a stopped batch says nothing about the program
+            if (CancellationGroup::currentCancelled()) {
+                run.complete = false;
+                run.passed = false;
+            }
+            if (!cacheKey.empty() && run.complete) {
+                cache.store(cacheKey, run);
+            }
+        }
+        if (passed) {
+            *passed = run.passed;
+        }
+        return (run.showHeader ? program.header : "") + run.output;
+    }
+
+    // Environment variable holding this validator's memory ceiling in MB, if it has one
+    virtual const wchar_t* memoryLimitVariable() const {
+        return nullptr;
+    }
+
+protected:
+    // Runs the program in a fresh process. With an expected-output file, stdout is compared
+    // with it while it streams and the first difference stops the program and turns the
+    // result into a wrong answer.
+    virtual ProgramRun execute(const PreparedProgram& program, const RunOptions& options) {
+        ProgramRun run;
+        DWORD exitCode = STILL_ACTIVE;
+        CommandOptions commandOptions;
+        commandOptions.memoryLimitMB = memoryLimitMB();
+        commandOptions.inputPath = options.inputPath;
+        commandOptions.exitCode = &exitCode;
+        commandOptions.pausable = true;
+
+        if (options.expectedOutputPath.empty()) {
+            run.output = "Execution output:\n" + runShellCommand(program.runCommand + " 2>&1", commandOptions);
+            run.passed = exitCode == 0;
+            run.complete = exitCode != STILL_ACTIVE;
+            return run;
+        }
+
+        OutputComparer comparer;
+        run.showHeader = false;
+        if (!comparer.open(std::filesystem::path(toWide(options.expectedOutputPath)))) {
+            run.output = "Cannot read expected output file: " + options.expectedOutputPath;
+            return run;
+        }
+        commandOptions.comparer = &comparer;
+        std::string output = runShellCommand(program.runCommand, commandOptions);
+        run.complete = exitCode != STILL_ACTIVE;
+        if (!comparer.matched()) {
+            run.output = "Wrong answer:\n" + comparer.mismatch() + "\nExecution output:\n" + output;
+            return run;
+        }
+        run.showHeader = true;
+        run.passed = exitCode == 0;
+        run.output = "Output matches the expected output.\nExecution output:\n" + output;
+        return run;
+    }
+
+    // Files whose contents a run depends on, for the run cache key. Empty when they cannot
+    // be determined, which keeps the run out of the cache.
+    virtual std::set<std::string> runDependencies(const PreparedProgram& program) {
+        return { fileKey(std::filesystem::path(toWide(program.sourcePath))) };
+    }
+
+    // Memory ceiling for this validator's commands; 0 selects the sandbox default
+    uintmax_t memoryLimitMB() const {
+        const wchar_t* variable = memoryLimitVariable();
+        return variable ? readEnvironmentNumber(variable, 0) : 0;
+    }
+
+    // Helper to run a command and capture output
+    std::string executeCommand(const std::string& command) {
+        CommandOptions options;
+        options.memoryLimitMB = memoryLimitMB();
+        return runShellCommand(command, options);
+    }
+
+    std::string escapeFilePath(const std::string& filePath) {
+        std::string escaped = filePath;
+        // Replace all backslashes with double backslashes for command line
+        size_t pos = 0;
+        while ((pos = escaped.find("\\", pos)) != std::string::npos) {
+            escaped.replace(pos, 1, "\\\\");
+            pos += 2;
+        }
+        return "\"" + escaped + "\"";
+    }
+};
+
+// Reverse-dependency index over files: for each file, the files that depend on it
+class DependencyGraph {
+public:
+    void setDependencies(const std::string& file, const std::set<std::string>& dependencies) {
+        remove(file);
+        m_dependencies[file] = dependencies;
+        for (const auto& dependency : dependencies) {
+            m_dependents[dependency].insert(file);
+        }
+    }
+
+    void remove(const std::string& file) {
+        auto it = m_dependencies.find(file);
+        if (it == m_dependencies.end()) {
+            return;
+        }
+        for (const auto& dependency : it->second) {
+            m_dependents[dependency].erase(file);
+        }
+        m_dependencies.erase(it);
+    }
+
+    // The given files plus every file that depends on one of them, directly or transitively
+    std::set<std::string> withDependents(const std::set<std::string>& files) const {
+        std::set<std::string> result(files.begin(), files.end());
+        std::vector<std::string> pending(files.begin(), files.end());
+        while (!pending.empty()) {
+            std::string file = pending.back();
+            pending.pop_back();
+            auto it = m_dependents.find(file);
+            if (it == m_dependents.end()) {
+                continue;
+            }
+            for (const auto& dependent : it->second) {
+                if (result.insert(dependent).second) {
+                    pending.push_back(dependent);
+                }
+            }
+        }
+        return result;
+    }
+
+private:
+    std::map<std::string, std::set<std::string>> m_dependencies;
+    std::map<std::string, std::set<std::string>> m_dependents;
+};
+
+std::vector<std::string> splitString(const std::string& text, char separator) {
+    std::vector<std::string> parts;
+    std::stringstream stream(text);
+    std::string part;
+    while (std::getline(stream, part, separator)) {
+        if (!part.empty()) {
+            parts.push_back(part);
+        }
+    }
+    return parts;
+}
+
+std::string joinStrings(const std::set<std::string>& parts, char separator) {
+    std::string text;
+    for (const auto& part : parts) {
+        if (!text.empty()) {
+            text += separator;
+        }
+        text += part;
+    }
+    return text;
+}
+
+// What a Java source declares and which type-like names it mentions. Comments and literals
+// are skipped; referenced names are the identifiers starting with an upper-case letter, which
+// over-approximates the types a file uses.
+struct JavaSourceInfo {
+    std::string packageName;
+    std::set<std::string> declaredTypes;
+    std::set<std::string> referencedTypes;
+};
+
+JavaSourceInfo scanJavaSource(const std::string& source) {
+    JavaSourceInfo info;
+    auto isIdentifierChar = [](char c) {
+        unsigned char u = static_cast<unsigned char>(c);
+        return std::isalnum(u) || c == '_' || c == '$' || u >= 0x80;
+    };
+
+    std::string previous;
+    size_t i = 0;
+    while (i < source.size()) {
+        char c = source[i];
+        if (c == '/' && source.compare(i, 2, "//") == 0) {
+            i = source.find('\n', i);
+            continue;
+        }
+        if (c == '/' && source.compare(i, 2, "/*") == 0) {
+            i = source.find("*/", i + 2);
+            i = i == std::string::npos ? i : i + 2;
+            continue;
+        }
+        if (source.compare(i, 3, "\"\"\"") == 0) {
+            i = source.find("\"\"\"", i + 3);
+            i = i == std::string::npos ? i : i + 3;
+            continue;
+        }
+        if (c == '"' || c == '\'') {
+            for (++i; i < source.size() && source[i] != c && source[i] != '\n'; ++i) {
+                if (source[i] == '\\') {
+                    ++i;
+                }
+            }
+            ++i;
+            previous.clear();
+            continue;
+        }
+        if (isIdentifierChar(c) && !std::isdigit(static_cast<unsigned char>(c))) {
+            size_t start = i;
+            while (i < source.size() && isIdentifierChar(source[i])) {
+                ++i;
+            }
+            std::string word = source.substr(start, i - start);
+            if (word == "package" && info.packageName.empty() && info.declaredTypes.empty()) {
+                size_t end = source.find(';', i);
+                for (char p : source.substr(i, end - i)) {
+                    if (!std::isspace(static_cast<unsigned char>(p))) {
+                        info.packageName += p;
+                    }
+                }
+                i = end;
+                previous.clear();
+                continue;
+            }
+            if (previous == "class" || previous == "interface" || previous == "enum" || previous == "record") {
+                info.declaredTypes.insert(word);
+            }
+            else if (std::isupper(static_cast<unsigned char>(word[0]))) {
+                info.referencedTypes.insert(word);
+            }
+            previous = word;
+            continue;
+        }
+        if (!std::isspace(static_cast<unsigned char>(c)) && c != '@') {
+            previous.clear();
+        }
+        ++i;
+    }
+    return info;
+}
+
+// The source root of a file in the given directory declaring the given package: the
+// directory with one level removed per package part. False for files without a package or
+// in directories that don't match it.
+bool javaSourceRoot(const std::filesystem::path& directory, const std::string& packageName, std::filesystem::path& root) {
+    if (packageName.empty()) {
+        return false;
+    }
+    root = directory;
+    std::vector<std::string> packageParts = splitString(packageName, '.');
+    for (auto it = packageParts.rbegin(); it != packageParts.rend(); ++it) {
+        if (root.filename().string() != *it) {
+            return false;
+        }
+        root = root.parent_path();
+    }
+    return true;
+}
+
+// Incremental compilation of the source tree a packaged Java file belongs to. Compiled classes
+// and per-file scan results are kept between runs under the app data directory; only files whose
+// contents changed, plus every file that references a type they declared (transitively), are
+// passed to javac, with the previous output on the class path for everything else.
+class JavaProject {
+public:
+    // Derives the source root from the file's package declaration. Returns false when the
+    // file has no package or sits in directories that don't match it.
+    bool open(const std::filesystem::path& file) {
+        JavaSourceInfo info = scanJavaSource(readFileContents(file));
+        std::filesystem::path root;
+        if (!javaSourceRoot(std::filesystem::absolute(file).parent_path(), info.packageName, root)) {
+            return false;
+        }
+
+        m_root = root;
+        m_mainClass = info.packageName + "." + file.stem().string();
+        m_workDirectory = appDataDirectory() / "javaproj" / toHex(fnv1a64(toUtf8(root.wstring())));
+        std::error_code ec;
+        std::filesystem::create_directories(outputDirectory(), ec);
+        return true;
+    }
+
+    std::filesystem::path outputDirectory() const {
+        return m_workDirectory / "classes";
+    }
+
+    const std::string& mainClass() const {
+        return m_mainClass;
+    }
+
+    // Brings the output directory up to date. Returns false with javac's output on failure.
+    bool build(const std::string& javacFlags, std::string& compileOutput, std::string& summary) {
+        // Builds share state files and output directories, so run one at a time
+        static std::mutex buildMutex;
+        std::lock_guard<std::mutex> lock(buildMutex);
+
+        std::error_code ec;
+        std::map<std::string, SourceState> previous = loadState();
+        if (std::filesystem::is_empty(outputDirectory(), ec)) {
+            previous.clear();
+        }
+        std::map<std::string, SourceState> current;
+        std::set<std::string> changed;
+
+        for (auto it = std::filesystem::recursive_directory_iterator(m_root, ec); !ec && it != std::filesystem::recursive_directory_iterator(); it.increment(ec)) {
+            if (it->is_directory(ec) && it->path().filename().string().rfind('.', 0) == 0) {
+                it.disable_recursion_pending();
+                continue;
+            }
+            if (!it->is_regular_file(ec) || it->path().extension() != ".java") {
+                continue;
+            }
+
+            std::string relative = toUtf8(std::filesystem::relative(it->path(), m_root, ec).generic_wstring());
+            SourceState state;
+            state.size = it->file_size(ec);
+            state.modified = it->last_write_time(ec).time_since_epoch().count();
+
+            auto old = previous.find(relative);
+            if (old != previous.end() && old->second.size == state.size && old->second.modified == state.modified && !old->second.hash.empty()) {
+                current[relative] = old->second;
+                continue;
+            }
+
+            std::string source = readFileContents(it->path());
+            JavaSourceInfo info = scanJavaSource(source);
+            state.hash = toHex(fnv1a64(source));
+            state.declaredTypes = info.declaredTypes;
+            state.referencedTypes = info.referencedTypes;
+            if (old == previous.end() || old->second.hash != state.hash) {
+                changed.insert(relative);
+            }
+            current[relative] = state;
+        }
+
+        // Types that were declared by changed or deleted files before this run matter too,
+        // since their users must now fail or pick up the new definition
+        std::map<std::string, std::set<std::string>> declaringFiles;
+        for (const auto& [file, state] : previous) {
+            if (!current.count(file) || changed.count(file)) {
+                for (const auto& type : state.declaredTypes) {
+                    declaringFiles[type].insert(file);
+                }
+                if (!current.count(file)) {
+                    removeClassFiles(file, state);
+                    changed.insert(file);
+                }
+            }
+        }
+        for (const auto& [file, state] : current) {
+            for (const auto& type : state.declaredTypes) {
+                declaringFiles[type].insert(file);
+            }
+        }
+
+        DependencyGraph graph;
+        for (const auto& [file, state] : current) {
+            std::set<std::string> dependencies;
+            for (const auto& type : state.referencedTypes) {
+                auto it = declaringFiles.find(type);
+                if (it != declaringFiles.end()) {
+                    dependencies.insert(it->second.begin(), it->second.end());
+                }
+            }
+            dependencies.erase(file);
+            graph.setDependencies(file, dependencies);
+        }
+
+        std::vector<std::string> toCompile;
+        for (const auto& file : graph.withDependents(changed)) {
+            if (current.count(file)) {
+                toCompile.push_back(file);
+            }
+        }
+        summary = "Project: recompiled " + std::to_string(toCompile.size()) + " of " + std::to_string(current.size()) + " files.";
+
+        bool compiled = true;
+        if (!toCompile.empty()) {
+            std::filesystem::path argumentFile = m_workDirectory / "sources.txt";
+            std::ofstream arguments(argumentFile, std::ios::trunc);
+            for (const auto& file : toCompile) {
+                arguments << "\"" << toUtf8((m_root / std::filesystem::path(toWide(file))).generic_wstring()) << "\"\n";
+            }
+            arguments.close();
+
+            std::string output = quoteArgument(toUtf8(outputDirectory().wstring()));
+            compileOutput = runShellCommand("javac " + javacFlags + "-implicit:none -d " + output + " -cp " + output
+                + " @" + quoteArgument(toUtf8(argumentFile.wstring())) + " 2>&1 && echo " + JAVAC_SUCCESS_MARKER);
+            size_t marker = compileOutput.rfind(JAVAC_SUCCESS_MARKER);
+            compiled = marker != std::string::npos;
+            if (compiled) {
+                compileOutput.erase(marker);
+            }
+            else {
+                // Compile these again next time even if they are left untouched
+                for (const auto& file : toCompile) {
+                    current[file].hash.clear();
+                }
+            }
+        }
+
+        saveState(current);
+        return compiled;
+    }
+
+private:
+    static constexpr char JAVAC_SUCCESS_MARKER[] = "CODEVALIDATOR_JAVAC_OK";
+
+    struct SourceState {
+        uintmax_t size = 0;
+        long long modified = 0;
+        std::string hash;
+        std::set<std::string> declaredTypes;
+        std::set<std::string> referencedTypes;
+    };
+
+    std::map<std::string, SourceState> loadState() const {
+        std::map<std::string, SourceState> states;
+        std::ifstream file(m_workDirectory / "state.txt");
+        std::string line;
+        while (std::getline(file, line)) {
+            std::vector<std::string> fields;
+            std::stringstream stream(line);
+            std::string field;
+            while (std::getline(stream, field, '\t')) {
+                fields.push_back(field);
+            }
+            if (fields.size() < 4) {
+                continue;
+            }
+            SourceState state;
+            try {
+                state.size = std::stoull(fields[1]);
+                state.modified = std::stoll(fields[2]);
+            }
+            catch (...) {
+                continue;
+            }
+            state.hash = fields[3];
+            if (fields.size() > 4) {
+                auto declared = splitString(fields[4], ',');
+                state.declaredTypes.insert(declared.begin(), declared.end());
+            }
+            if (fields.size() > 5) {
+                auto referenced = splitString(fields[5], ',');
+                state.referencedTypes.insert(referenced.begin(), referenced.end());
+            }
+            states[fields[0]] = state;
+        }
+        return states;
+    }
+
+    void saveState(const std::map<std::string, SourceState>& states) const {
+        std::ofstream file(m_workDirectory / "state.txt", std::ios::trunc);
+        for (const auto& [path, state] : states) {
+            file << path << '\t' << state.size << '\t' << state.modified << '\t' << state.hash << '\t'
+                << joinStrings(state.declaredTypes, ',') << '\t' << joinStrings(state.referencedTypes, ',') << '\n';
+        }
+    }
+
+    // Deletes the classes a removed source produced, including nested and anonymous classes
+    void removeClassFiles(const std::string& file, const SourceState& state) const {
+        std::filesystem::path packageDirectory = outputDirectory() / std::filesystem::path(toWide(file)).parent_path();
+        std::error_code ec;
+        for (const auto& entry : std::filesystem::directory_iterator(packageDirectory, ec)) {
+            std::string name = entry.path().stem().string();
+            for (const auto& type : state.declaredTypes) {
+                if (entry.path().extension() == ".class" && (name == type || name.rfind(type + "$", 0) == 0)) {
+                    std::filesystem::remove(entry.path(), ec);
+                    break;
+                }
+            }
+        }
+    }
+
+    std::filesystem::path m_root;
+    std::filesystem::path m_workDirectory;
+    std::string m_mainClass;
+};
+
+// Java validator
+class JavaValidator : public LanguageValidator {
+public:
+    bool isCompatible(const std::string& filePath) override {
+        std::filesystem::path path(filePath);
+        return path.extension() == ".java";
+    }
+
+    const wchar_t* memoryLimitVariable() const override {
+        return L"CODEVALIDATOR_JAVA_MEMORY_MB";
+    }
+
+    PreparedProgram prepare(const std::string& filePath) override {
+        PreparedProgram program;
+        program.sourcePath = filePath;
+        std::filesystem::path path(filePath);
+        std::string className = path.stem().string();
+        std::string directory = path.parent_path().string();
+
+        JavaToolchain& toolchain = JavaToolchain::instance();
+        program.toolchain = toolchain.fingerprint();
+        std::string runtimeFlags = StartupProfiles::instance().flags("java");
+
+        // Packaged files are compiled as part of their source tree, incrementally
+        JavaProject project;
+        if (project.open(path)) {
+            std::string compileOutput;
+            std::string summary;
+            if (!project.build(prefixEach(runtimeFlags, "-J") + toolchain.javacFlags(), compileOutput, summary)) {
+                program.failure = "Compilation errors:\n" + compileOutput;
+                return program;
+            }
+
+            program.runCommand = "cd " + escapeFilePath(directory) + " && java " + runtimeFlags + toolchain.javaFlags()
+                + "-cp " + quoteArgument(toUtf8(project.outputDirectory().wstring())) + " " + project.mainClass();
+            program.header = "Compilation successful.\n" + summary + "\n";
+            program.buildDirectory = project.outputDirectory();
+            return program;
+        }
+
+        // Compile Java file
+        std::string compileCommand = "javac " + prefixEach(runtimeFlags, "-J") + toolchain.javacFlags() + escapeFilePath(filePath) + " 2>&1";
+        std::string compileResult = executeCommand(compileCommand);
+
+        if (!compileResult.empty()) {
+            program.failure = "Compilation errors:\n" + compileResult;
+            return program;
+        }
+
+        // Run the class file
+        program.runCommand = "cd " + escapeFilePath(directory) + " && java " + runtimeFlags + toolchain.javaFlags() + className;
+        program.buildDirectory = path.parent_path();
+        return program;
+    }
+
+protected:
+    // The run loads whichever classes it needs from the class directory
+    std::set<std::string> runDependencies(const PreparedProgram& program) override {
+        std::set<std::string> files = LanguageValidator::runDependencies(program);
+        std::error_code ec;
+        for (auto it = std::filesystem::recursive_directory_iterator(program.buildDirectory, ec);
+            !ec && it != std::filesystem::recursive_directory_iterator(); it.increment(ec)) {
+            if (it->is_regular_file(ec) && it->path().extension() == ".class") {
+                files.insert(fileKey(it->path()));
+            }
+        }
+        return files;
+    }
+};
+
+// Python statements with comments, docstrings and line continuations removed
+std::vector<std::string> pythonLogicalLines(const std::string& source) {
+    std::vector<std::string> lines;
+    std::string current;
+    int openBrackets = 0;
+    const char* tripleQuote = nullptr;
+
+    std::stringstream stream(source);
+    std::string line;
+    while (std::getline(stream, line)) {
+        for (size_t i = 0; i < line.size(); ++i) {
+            if (tripleQuote) {
+                if (line.compare(i, 3, tripleQuote) == 0) {
+                    i += 2;
+                    tripleQuote = nullptr;
+                }
+                continue;
+            }
+            char c = line[i];
+            if (line.compare(i, 3, "\"\"\"") == 0 || line.compare(i, 3, "'''") == 0) {
+                tripleQuote = c == '"' ? "\"\"\"" : "'''";
+                i += 2;
+                continue;
+            }
+            if (c == '#') {
+                break;
+            }
+            if (c == '"' || c == '\'') {
+                size_t end = i + 1;
+                while (end < line.size() && line[end] != c) {
+                    end += line[end] == '\\' ? 2 : 1;
+                }
+                current += line.substr(i, end - i + 1);
+                i = end;
+                continue;
+            }
+            if (c == '(' || c == '[' || c == '{') {
+                openBrackets++;
+            }
+            else if ((c == ')' || c == ']' || c == '}') && openBrackets > 0) {
+                openBrackets--;
+            }
+            current += c;
+        }
+
+        if (!current.empty() && current.back() == '\r') {
+            current.pop_back();
+        }
+        if (!current.empty() && current.back() == '\\') {
+            current.pop_back();
+            continue;
+        }
+        if (openBrackets > 0 || tripleQuote) {
+            current += ' ';
+            continue;
+        }
+        for (const auto& statement : splitString(current, ';')) {
+            lines.push_back(trimString(statement));
+        }
+        current.clear();
+    }
+    return lines;
+}
+
+// Files a Python module name refers to inside the tree: the module itself and the
+// __init__.py of every package on the way, which importing it also executes.
+// Empty when the module lives outside the tree (standard library, site-packages).
+std::vector<std::filesystem::path> resolvePythonModule(const std::filesystem::path& importer, int level,
+    const std::string& module, const std::filesystem::path& root) {
+    std::vector<std::filesystem::path> searchDirectories;
+    if (level > 0) {
+        std::filesystem::path base = importer.parent_path();
+        for (int i = 1; i < level; ++i) {
+            base = base.parent_path();
+        }
+        searchDirectories.push_back(base);
+    }
+    else {
+        // A script's own directory comes first on sys.path, then the tree root
+        searchDirectories = { importer.parent_path(), root };
+    }
+
+    std::vector<std::string> parts = splitString(module, '.');
+    std::error_code ec;
+    for (const auto& directory : searchDirectories) {
+        std::vector<std::filesystem::path> files;
+        if (parts.empty() && std::filesystem::exists(directory / "__init__.py", ec)) {
+            files.push_back(directory / "__init__.py");
+        }
+
+        std::filesystem::path current = directory;
+        bool resolved = true;
+        for (size_t i = 0; i < parts.size(); ++i) {
+            current /= parts[i];
+            std::filesystem::path moduleFile = current;
+            moduleFile += ".py";
+            if (std::filesystem::exists(current / "__init__.py", ec)) {
+                files.push_back(current / "__init__.py");
+            }
+            else if (i + 1 == parts.size() && std::filesystem::exists(moduleFile, ec)) {
+                files.push_back(moduleFile);
+            }
+            else if (!std::filesystem::is_directory(current, ec)) {
+                resolved = false;
+                break;
+            }
+        }
+        if (resolved && !files.empty()) {
+            return files;
+        }
+    }
+    return {};
+}
+
+// Files inside the tree that a Python file imports, from import and from-import statements
+// anywhere in the file (including ones inside functions or try blocks)
+std::set<std::string> scanPythonImports(const std::filesystem::path& file, const std::filesystem::path& root) {
+    std::set<std::string> dependencies;
+    auto add = [&](int level, const std::string& module) {
+        for (const auto& dependency : resolvePythonModule(file, level, module, root)) {
+            dependencies.insert(fileKey(dependency));
+        }
+    };
+    auto firstWord = [](const std::string& text) {
+        std::stringstream stream(text);
+        std::string word;
+        stream >> word;
+        return word;
+    };
+
+    for (const auto& line : pythonLogicalLines(readFileContents(file))) {
+        if (line.rfind("import ", 0) == 0) {
+            for (const auto& name : splitString(line.substr(7), ',')) {
+                add(0, firstWord(name));
+            }
+        }
+        else if (line.rfind("from ", 0) == 0) {
+            size_t importPos = line.find(" import ");
+            if (importPos == std::string::npos) {
+                continue;
+            }
+            std::string module = trimString(line.substr(5, importPos - 5));
+            int level = 0;
+            while (level < static_cast<int>(module.size()) && module[level] == '.') {
+                level++;
+            }
+            module = module.substr(level);
+            add(level, module);
+
+            // "from package import name" may name a submodule
+            std::string names = line.substr(importPos + 8);
+            names.erase(std::remove(names.begin(), names.end(), '('), names.end());
+            names.erase(std::remove(names.begin(), names.end(), ')'), names.end());
+            for (const auto& name : splitString(names, ',')) {
+                std::string word = firstWord(name);
+                if (!word.empty() && word != "*") {
+                    add(level, module.empty() ? word : module + "." + word);
+                }
+            }
+        }
+    }
+    dependencies.erase(fileKey(file));
+    return dependencies;
+}
+
+// String literals and identifiers of a JavaScript source, skipping comments and template literals
+struct JavaScriptToken {
+    bool isString = false;
+    std::string text;
+};
+
+std::vector<JavaScriptToken> tokenizeJavaScript(const std::string& source) {
+    std::vector<JavaScriptToken> tokens;
+    size_t i = 0;
+    while (i < source.size()) {
+        char c = source[i];
+        if (source.compare(i, 2, "//") == 0) {
+            i = source.find('\n', i);
+        }
+        else if (source.compare(i, 2, "/*") == 0) {
+            i = source.find("*/", i + 2);
+            i = i == std::string::npos ? i : i + 2;
+        }
+        else if (c == '"' || c == '\'' || c == '`') {
+            size_t end = i + 1;
+            while (end < source.size() && source[end] != c && (c == '`' || source[end] != '\n')) {
+                end += source[end] == '\\' ? 2 : 1;
+            }
+            if (c != '`') {
+                tokens.push_back({ true, source.substr(i + 1, std::min(end, source.size()) - i - 1) });
+            }
+            i = end + 1;
+        }
+        else if (std::isalpha(static_cast<unsigned char>(c)) || c == '_' || c == '$') {
+            size_t end = i;
+            while (end < source.size() && (std::isalnum(static_cast<unsigned char>(source[end])) || source[end] == '_' || source[end] == '$')) {
+                end++;
+            }
+            tokens.push_back({ false, source.substr(i, end - i) });
+            i = end;
+        }
+        else {
+            if (!std::isspace(static_cast<unsigned char>(c))) {
+                tokens.push_back({ false, std::string(1, c) });
+            }
+            i++;
+        }
+        if (i == std::string::npos) {
+            break;
+        }
+    }
+    return tokens;
+}
+
+// Resolves a path the way node does: the exact file, the file with a known extension,
+// then a directory's package.json "main" or index file
+std::filesystem::path resolveJavaScriptPath(const std::filesystem::path& path) {
+    static const char* extensions[] = { ".js", ".mjs", ".cjs", ".json" };
+    std::error_code ec;
+    if (std::filesystem::is_regular_file(path, ec)) {
+        return path;
+    }
+    for (const char* extension : extensions) {
+        std::filesystem::path candidate = path;
+        candidate += extension;
+        if (std::filesystem::is_regular_file(candidate, ec)) {
+            return candidate;
+        }
+    }
+    if (!std::filesystem::is_directory(path, ec)) {
+        return {};
+    }
+
+    std::smatch match;
+    std::string manifest = readFileContents(path / "package.json");
+    if (std::regex_search(manifest, match, std::regex("\"main\"\\s*:\\s*\"([^\"]+)\""))) {
+        std::filesystem::path main = resolveJavaScriptPath(path / toWide(match[1].str()));
+        if (!main.empty()) {
+            return main;
+        }
+    }
+    for (const char* extension : extensions) {
+        std::filesystem::path candidate = path / "index";
+        candidate += extension;
+        if (std::filesystem::is_regular_file(candidate, ec)) {
+            return candidate;
+        }
+    }
+    return {};
+}
+
+// File a require or import specifier refers to inside the tree, or empty for built-in
+// modules and files outside it
+std::filesystem::path resolveJavaScriptSpecifier(const std::filesystem::path& importer, const std::string& specifier,
+    const std::filesystem::path& root) {
+    if (specifier.empty() || specifier.rfind("node:", 0) == 0) {
+        return {};
+    }
+    if (specifier.rfind("./", 0) == 0 || specifier.rfind("../", 0) == 0 || specifier == "." || specifier == "..") {
+        return resolveJavaScriptPath((importer.parent_path() / toWide(specifier)).lexically_normal());
+    }
+
+    // Bare specifiers are looked up in node_modules directories up to the tree root
+    std::string rootKey = fileKey(root);
+    for (std::filesystem::path directory = importer.parent_path(); ; directory = directory.parent_path()) {
+        std::filesystem::path resolved = resolveJavaScriptPath(directory / "node_modules" / toWide(specifier));
+        if (!resolved.empty()) {
+            return resolved;
+        }
+        if (fileKey(directory) == rootKey || directory == directory.parent_path()) {
+            return {};
+        }
+    }
+}
+
+// Files inside the tree that a JavaScript file loads through require(), static import or
+// export-from declarations, and dynamic import() calls with a literal specifier
+std::set<std::string> scanJavaScriptImports(const std::filesystem::path& file, const std::filesystem::path& root) {
+    std::vector<JavaScriptToken> tokens = tokenizeJavaScript(readFileContents(file));
+    auto isText = [&](size_t i, const char* text) {
+        return i < tokens.size() && !tokens[i].isString && tokens[i].text == text;
+    };
+    auto isString = [&](size_t i) {
+        return i < tokens.size() && tokens[i].isString;
+    };
+
+    std::set<std::string> dependencies;
+    for (size_t i = 0; i < tokens.size(); ++i) {
+        const std::string* specifier = nullptr;
+        if ((isText(i, "require") || isText(i, "import")) && isText(i + 1, "(") && isString(i + 2)) {
+            specifier = &tokens[i + 2].text;
+        }
+        else if ((isText(i, "import") || isText(i, "from")) && isString(i + 1)) {
+            specifier = &tokens[i + 1].text;
+        }
+        if (specifier) {
+            std::filesystem::path resolved = resolveJavaScriptSpecifier(file, *specifier, root);
+            if (!resolved.empty()) {
+                dependencies.insert(fileKey(resolved));
+            }
+        }
+    }
+    dependencies.erase(fileKey(file));
+    return dependencies;
+}
+
+// A file and every file it loads directly or indirectly from its own directory tree
+std::set<std::string> importClosure(const std::filesystem::path& file,
+    const std::function<std::set<std::string>(const std::filesystem::path& file, const std::filesystem::path& root)>& scanner) {
+    std::error_code ec;
+    std::filesystem::path root = std::filesystem::absolute(file, ec).parent_path();
+    std::set<std::string> files = { fileKey(file) };
+    std::vector<std::string> pending(files.begin(), files.end());
+    while (!pending.empty()) {
+        std::filesystem::path next(toWide(pending.back()));
+        pending.pop_back();
+        for (const auto& dependency : scanner(next, root)) {
+            if (files.insert(dependency).second) {
+                pending.push_back(dependency);
+            }
+        }
+    }
+    return files;
+}
+
+// Waits for a script path on stdin, then runs it as __main__ in this otherwise fresh
+// interpreter. A script whose directory holds its own version of a preloaded module is
+// handed back with PYTHON_COLD_MARKER, since a direct launch would import that version.
+// Uncaught exceptions are reported without the bootstrap's and runpy's frames.
+constexpr char PYTHON_BOOTSTRAP[] = R"(import sys
+# Loaded by a direct launch too by this point, so the script's directory cannot shadow them
+startup = {name.partition('.')[0] for name in sys.modules}
+import os, runpy
+
+for name in sys.argv[1].split(','):
+    try:
+        __import__(name)
+    except Exception:
+        pass
+
+path = sys.stdin.buffer.readline().decode('utf-8').rstrip('\n')
+if not path:
+    sys.exit(0)
+sys.argv = [path]
+# Match a direct launch: the script directory replaces ours unless -P left it out
+if sys.path and sys.path[0] == os.path.dirname(os.path.abspath(__file__)):
+    directory = os.path.dirname(os.path.abspath(path))
+    sys.path[0] = directory
+    # A direct launch would import the script directory's own version of a preloaded
+    # module, so such scripts are handed back for a cold start
+    for name in {name.partition('.')[0] for name in sys.modules} - startup:
+        if os.path.isfile(os.path.join(directory, name + '.py')) or os.path.isfile(os.path.join(directory, name, '__init__.py')):
+            sys.stdout.write('CODEVALIDATOR:COLD\n')
+            sys.exit(0)
+try:
+    runpy.run_path(path, run_name='__main__')
+except SystemExit:
+    raise
+except BaseException as error:
+    # Reported as a direct launch reports it, from the script's first frame on
+    frames = error.__traceback__
+    while frames is not None and frames.tb_frame.f_code.co_filename != path:
+        frames = frames.tb_next
+    sys.excepthook(type(error), error.with_traceback(frames), frames)
+    sys.exit(1)
+)";
+
+constexpr char PYTHON_COLD_MARKER[] = "CODEVALIDATOR:COLD\n";
+
+constexpr uintmax_t DEFAULT_PYCACHE_LIMIT_MB = 256;
+
+constexpr char DEFAULT_PYTHON_PRELOAD[] = "os,sys,re,json,math,random,collections,itertools,functools,datetime,typing";
+
+// Python validator
+class PythonValidator : public LanguageValidator {
+public:
+    bool isCompatible(const std::string& filePath) override {
+        std::filesystem::path path(filePath);
+        return path.extension() == ".py";
+    }
+
+    const wchar_t* memoryLimitVariable() const override {
+        return L"CODEVALIDATOR_PYTHON_MEMORY_MB";
+    }
+
+    PreparedProgram prepare(const std::string& filePath) override {
+        PreparedProgram program;
+        program.sourcePath = filePath;
+        program.toolchain = executableFingerprint("python");
+
+        // Check syntax without running
+        std::string syntaxCommand = pythonCommand() + "-m py_compile " + escapeFilePath(filePath) + " 2>&1";
+        std::string syntaxResult = executeCommand(syntaxCommand);
+
+        if (!syntaxResult.empty() && syntaxResult.find("SyntaxError") != std::string::npos) {
+            program.failure = "Syntax errors:\n" + syntaxResult;
+            return program;
+        }
+
+        program.runCommand = pythonCommand() + escapeFilePath(filePath);
+        return program;
+    }
+
+protected:
+    ProgramRun execute(const PreparedProgram& program, const RunOptions& options) override {
+        ProgramRun run;
+        if (options.allowsWarmStart() && runWarm(program.sourcePath, memoryLimitMB(), run)) {
+            return run;
+        }
+        return LanguageValidator::execute(program, options);
+    }
+
+    std::set<std::string> runDependencies(const PreparedProgram& program) override {
+        return importClosure(std::filesystem::path(toWide(program.sourcePath)), scanPythonImports);
+    }
+
+private:
+    // Interpreter command with its startup profile and a shared bytecode cache. The cache
+    // keeps __pycache__ out of the validated tree, works for read-only checkouts and is shared
+    // by every run and process. -X is used rather than PYTHONPYCACHEPREFIX so that the setting
+    // travels with the command line, warm interpreters included, and the program sees the
+    // environment it was started with.
+    static std::string pythonCommand() {
+        static const std::filesystem::path cacheDirectory = appDataDirectory() / "pycache";
+        trimBytecodeCache(cacheDirectory);
+        return StartupProfiles::instance().command("python") + "-X pycache_prefix=" + quoteArgument(toUtf8(cacheDirectory.wstring())) + " ";
+    }
+
+    // Keeps the bytecode cache under CODEVALIDATOR_PYCACHE_LIMIT_MB, checking at most every ten minutes
+    static void trimBytecodeCache(const std::filesystem::path& cacheDirectory) {
+        static std::mutex trimMutex;
+        static std::chrono::steady_clock::time_point lastTrim;
+        {
+            std::lock_guard<std::mutex> lock(trimMutex);
+            auto now = std::chrono::steady_clock::now();
+            if (lastTrim != std::chrono::steady_clock::time_point() && now - lastTrim < std::chrono::minutes(10)) {
+                return;
+            }
+            lastTrim = now;
+        }
+
+        uintmax_t limit = readEnvironmentNumber(L"CODEVALIDATOR_PYCACHE_LIMIT_MB", DEFAULT_PYCACHE_LIMIT_MB);
+        std::thread(trimDirectory, cacheDirectory, limit * 1024 * 1024).detach();
+    }
+
+    // Runs the script in a pre-started interpreter. Disabled with CODEVALIDATOR_PYTHON_WARM=0;
+    // the modules to preload come from CODEVALIDATOR_PYTHON_PRELOAD (comma separated).
+    // There is one pool per interpreter command line, so a new startup profile gets its own.
+    static bool runWarm(const std::string& filePath, uintmax_t memoryLimitMB, ProgramRun& run) {
+        static const bool enabled = readEnvironment(L"CODEVALIDATOR_PYTHON_WARM", "1") != "0";
+        if (!enabled || StartupProfiles::isTuning()) {
+            return false;
+        }
+
+        static const std::string bootstrapArguments = [] {
+            std::filesystem::path bootstrap = appDataDirectory() / "python_bootstrap.py";
+            writeFileIfChanged(bootstrap, PYTHON_BOOTSTRAP);
+            std::string preload = readEnvironment(L"CODEVALIDATOR_PYTHON_PRELOAD", DEFAULT_PYTHON_PRELOAD);
+            return quoteArgument(toUtf8(bootstrap.wstring())) + " " + quoteArgument(preload);
+        }();
+        WarmInterpreterPool& pool = WarmInterpreterPool::forCommand(pythonCommand() + bootstrapArguments);
+        AdmissionControl::Ticket admission;
+        std::unique_ptr<ChildProcess> interpreter = pool.acquire();
+        if (!interpreter) {
+            return false;
+        }
+        interpreter->setMemoryLimit(memoryLimitMB);
+        CancellationGroup::Member member(interpreter->job());
+        BackgroundPause::Pausable pausable(interpreter->job());
+        if (!interpreter->writeInput(filePath + "\n")) {
+            return false;
+        }
+        interpreter->closeInput();
+        std::string output = interpreter->readOutput();
+        if (output.rfind(PYTHON_COLD_MARKER, 0) == 0) {
+            return false;
+        }
+        run.output = "Execution output:\n" + output;
+        run.passed = interpreter->exitCode() == 0;
+        run.complete = true;
+        return true;
+    }
+};
+
+// String literals and lower-cased identifiers of a PHP source, skipping comments. Double-quoted
+// strings that interpolate variables are kept as a non-literal token.
+std::vector<JavaScriptToken> tokenizePhp(const std::string& source) {
+    std::vector<JavaScriptToken> tokens;
+    size_t i = 0;
+    while (i < source.size()) {
+        char c = source[i];
+        if (source.compare(i, 2, "//") == 0 || (c == '#' && source.compare(i, 2, "#[") != 0)) {
+            i = source.find('\n', i);
+        }
+        else if (source.compare(i, 2, "/*") == 0) {
+            i = source.find("*/", i + 2);
+            i = i == std::string::npos ? i : i + 2;
+        }
+        else if (c == '"' || c == '\'') {
+            std::string text;
+            bool interpolated = false;
+            size_t end = i + 1;
+            while (end < source.size() && source[end] != c) {
+                if (source[end] == '\\' && end + 1 < source.size()) {
+                    end++;
+                }
+                else if (c == '"' && source[end] == '$') {
+                    interpolated = true;
+                }
+                text += source[end++];
+            }
+            tokens.push_back(interpolated ? JavaScriptToken{ false, "\"" } : JavaScriptToken{ true, text });
+            i = end + 1;
+        }
+        else if (std::isalpha(static_cast<unsigned char>(c)) || c == '_') {
+            size_t end = i;
+            while (end < source.size() && (std::isalnum(static_cast<unsigned char>(source[end])) || source[end] == '_')) {
+                end++;
+            }
+            std::string identifier = source.substr(i, end - i);
+            std::transform(identifier.begin(), identifier.end(), identifier.begin(),
+                [](unsigned char letter) { return static_cast<char>(std::tolower(letter)); });
+            tokens.push_back({ false, identifier });
+            i = end;
+        }
+        else {
+            if (!std::isspace(static_cast<unsigned char>(c))) {
+                tokens.push_back({ false, std::string(1, c) });
+            }
+            i++;
+        }
+        if (i == std::string::npos) {
+            break;
+        }
+    }
+    return tokens;
+}
+
+// Adds the files a PHP file includes or requires: literal paths, taken relative to the
+// file's directory, and literals appended to __DIR__ or dirname(__FILE__). False when an
+// include uses any other expression or names a missing file, since the files a run reads
+// are then unknown.
+bool scanPhpIncludes(const std::filesystem::path& file, std::set<std::string>& includes) {
+    std::vector<JavaScriptToken> tokens = tokenizePhp(readFileContents(file));
+    auto isText = [&](size_t i, const char* text) {
+        return i < tokens.size() && !tokens[i].isString && tokens[i].text == text;
+    };
+    auto isString = [&](size_t i) {
+        return i < tokens.size() && tokens[i].isString;
+    };
+
+    std::filesystem::path directory = file.parent_path();
+    for (size_t i = 0; i < tokens.size(); ++i) {
+        if (!isText(i, "include") && !isText(i, "include_once") && !isText(i, "require") && !isText(i, "require_once")) {
+            continue;
+        }
+        // Variables, methods and constants that merely share the name
+        if (i > 0 && (isText(i - 1, "$") || isText(i - 1, ">") || isText(i - 1, ":"))) {
+            continue;
+        }
+
+        size_t next = i + 1;
+        bool parenthesized = isText(next, "(");
+        next += parenthesized ? 1 : 0;
+        std::filesystem::path included;
+        if (isString(next)) {
+            included = directory / toWide(tokens[next].text);
+            next += 1;
+        }
+        else if (isText(next, "__dir__") && isText(next + 1, ".") && isString(next + 2)) {
+            included = toWide(toUtf8(directory.wstring()) + tokens[next + 2].text);
+            next += 3;
+        }
+        else if (isText(next, "dirname") && isText(next + 1, "(") && isText(next + 2, "__file__") && isText(next + 3, ")")
+            && isText(next + 4, ".") && isString(next + 5)) {
+            included = toWide(toUtf8(directory.wstring()) + tokens[next + 5].text);
+            next += 6;
+        }
+        else {
+            return false;
+        }
+        if (parenthesized && !isText(next++, ")")) {
+            return false;
+        }
+        std::error_code ec;
+        if ((!isText(next, ";") && !isText(next, "?")) || !std::filesystem::is_regular_file(included, ec)) {
+            return false;
+        }
+        includes.insert(fileKey(included.lexically_normal()));
+    }
+    return true;
+}
+
+// PHP validator
+class PHPValidator : public LanguageValidator {
+public:
+    bool isCompatible(const std::string& filePath) override {
+        std::filesystem::path path(filePath);
+        return path.extension() == ".php";
+    }
+
+    const wchar_t* memoryLimitVariable() const override {
+        return L"CODEVALIDATOR_PHP_MEMORY_MB";
+    }
+
+    PreparedProgram prepare(const std::string& filePath) override {
+        PreparedProgram program;
+        program.sourcePath = filePath;
+        program.toolchain = executableFingerprint("php");
+
+        // Check syntax without running
+        std::string syntaxCommand = StartupProfiles::instance().command("php") + "-l " + escapeFilePath(filePath) + " 2>&1";
+        std::string syntaxResult = executeCommand(syntaxCommand);
+
+        // php -l reports "Errors parsing" for a real syntax error; anything else means the
+        // check itself did not run, which must not be cached as a verdict on the file
+        if (syntaxResult.find("No syntax errors") == std::string::npos) {
+            program.failure = (syntaxResult.find("Errors parsing") != std::string::npos ? "Syntax errors:\n" : "Cannot check syntax:\n") + syntaxResult;
+            return program;
+        }
+
+        program.runCommand = StartupProfiles::instance().command("php") + escapeFilePath(filePath);
+        return program;
+    }
+
+    // The script and everything it includes, directly or through other included files
+    std::set<std::string> runDependencies(const PreparedProgram& program) override {
+        std::set<std::string> files = LanguageValidator::runDependencies(program);
+        std::vector<std::string> pending(files.begin(), files.end());
+        while (!pending.empty()) {
+            std::filesystem::path next(toWide(pending.back()));
+            pending.pop_back();
+            std::set<std::string> includes;
+            if (!scanPhpIncludes(next, includes)) {
+                return {};
+            }
+            for (const auto& include : includes) {
+                if (files.insert(include).second) {
+                    pending.push_back(include);
+                }
+            }
+        }
+        return files;
+    }
+};
+
+constexpr uintmax_t NODE_COMPILE_CACHE_LIMIT_MB = 256;
+
+// Waits for a script path on stdin, checks its syntax and runs it as the main module.
+// The first output line tells the validator which happened. Sources that fail the CommonJS
+// compile are handed back (RECHECK) so that node --check gives the authoritative verdict,
+// e.g. for ES modules. When node builds a startup snapshot from this file, main() becomes
+// the snapshot's entry point and the module loading below is already done at launch.
+constexpr char NODE_BOOTSTRAP[] = R"('use strict';
+const fs = require('fs');
+const vm = require('vm');
+const Module = require('module');
+const v8 = require('v8');
+
+function readScriptPath() {
+  const buffer = Buffer.alloc(4096);
+  const chunks = [];
+  for (;;) {
+    let bytes = 0;
+    try {
+      bytes = fs.readSync(0, buffer, 0, buffer.length, null);
+    } catch (error) {
+      if (error.code === 'EAGAIN') continue;
+      if (error.code === 'EOF') break;
+      throw error;
+    }
+    if (bytes === 0) break;
+    chunks.push(Buffer.from(buffer.subarray(0, bytes)));
+    if (buffer.subarray(0, bytes).includes(10)) break;
+  }
+  return Buffer.concat(chunks).toString('utf8').split('\n')[0].trim();
+}
+
+function main() {
+  const file = readScriptPath();
+  if (!file) return;
+
+  let source = fs.readFileSync(file, 'utf8');
+  if (source.startsWith('#!')) source = '//' + source.slice(2);
+  try {
+    new vm.Script(Module.wrap(source), { filename: file });
+  } catch (error) {
+    fs.writeSync(1, 'CODEVALIDATOR:RECHECK\n');
+    return;
+  }
+
+  fs.writeSync(1, 'CODEVALIDATOR:RUN\n');
+  process.argv[1] = file;
+  Module.runMain(file);
+}
+
+if (v8.startupSnapshot && v8.startupSnapshot.isBuildingSnapshot()) {
+  v8.startupSnapshot.setDeserializeMainFunction(main);
+} else {
+  main();
+}
+)";
+
+constexpr char NODE_RUN_MARKER[] = "CODEVALIDATOR:RUN\n";
+
+// JavaScript validator
+class JavaScriptValidator : public LanguageValidator {
+public:
+    bool isCompatible(const std::string& filePath) override {
+        std::filesystem::path path(filePath);
+        return path.extension() == ".js";
+    }
+
+    const wchar_t* memoryLimitVariable() const override {
+        return L"CODEVALIDATOR_NODE_MEMORY_MB";
+    }
+
+    PreparedProgram prepare(const std::string& filePath) override {
+        PreparedProgram program;
+        program.sourcePath = filePath;
+        program.toolchain = executableFingerprint("node");
+        compileCacheDirectory();
+
+        std::string checkCommand = StartupProfiles::instance().command("node") + "--check " + escapeFilePath(filePath) + " 2>&1";
+        std::string checkResult = executeCommand(checkCommand);
+        if (!checkResult.empty()) {
+            program.failure = "Syntax errors:\n" + checkResult;
+            return program;
+        }
+
+        program.runCommand = StartupProfiles::instance().command("node") + escapeFilePath(filePath);
+        return program;
+    }
+
+    std::string validate(const std::string& filePath, const RunOptions& options, bool* passed = nullptr) override {
+        if (passed) {
+            *passed = false;
+        }
+        std::filesystem::path cacheDirectory = compileCacheDirectory();
+
+        // Compile cache hits are only worked out for the timing report, since each check walks
+        // the whole cache directory. Validations running side by side add entries to the same
+        // directory, so under concurrency the reported rate is approximate.
+        bool timed = ValidationTimings::enabled();
+
+        // Check and run in one go in a warm worker when possible. Deterministic programs take
+        // the separate check and run phases instead, so that the run can come from the run cache.
+        CacheState warmCacheBefore = timed ? readCacheState(cacheDirectory) : CacheState();
+        auto warmStart = std::chrono::steady_clock::now();
+        ProgramRun warmRun;
+        if (options.allowsWarmStart() && !RunCache::appliesTo(filePath, options) && runWarm(filePath, memoryLimitMB(), warmRun)) {
+            double warmMilliseconds = ValidationTimings::millisecondsSince(warmStart);
+            if (passed) {
+                *passed = warmRun.passed;
+            }
+            std::string result = "Compilation successful.\n" + warmRun.output;
+            if (timed) {
+                bool cacheHit = warmCacheBefore.entries > 0 && readCacheState(cacheDirectory) == warmCacheBefore;
+                ValidationTimings& timings = ValidationTimings::instance();
+                timings.recordCache("node compile cache", cacheHit);
+                result += "\nTiming: check and run " + std::to_string(static_cast<int>(warmMilliseconds))
+                    + " ms in a warm worker, compile cache " + (cacheHit ? "hit" : "miss")
+                    + " (" + timings.hitRate("node compile cache") + ")";
+            }
+            return result;
+        }
+
+        // Use Node.js to validate and run the script
+        auto checkStart = std::chrono::steady_clock::now();
+        PreparedProgram program = prepare(filePath);
+        double checkMilliseconds = ValidationTimings::millisecondsSince(checkStart);
+
+        if (!program.failure.empty()) {
+            return program.failure;
+        }
+
+        CacheState cacheBefore = timed ? readCacheState(cacheDirectory) : CacheState();
+        auto runStart = std::chrono::steady_clock::now();
+        std::string result = runProgram(program, options, passed);
+        double runMilliseconds = ValidationTimings::millisecondsSince(runStart);
+
+        if (timed) {
+            // Node only writes cache entries for code it had to compile, so an unchanged
+            // cache means every module was served from it
+            bool cacheHit = cacheBefore.entries > 0 && readCacheState(cacheDirectory) == cacheBefore;
+            ValidationTimings& timings = ValidationTimings::instance();
+            timings.recordCache("node compile cache", cacheHit);
+            result += "\nTiming: check " + std::to_string(static_cast<int>(checkMilliseconds)) + " ms, run "
+                + std::to_string(static_cast<int>(runMilliseconds)) + " ms, compile cache "
+                + (cacheHit ? "hit" : "miss") + " (" + timings.hitRate("node compile cache") + ")";
+        }
+        return result;
+    }
+
+    // Self-check for the benchmark: a script must run in a warm worker started from a
+    // startup snapshot. Describes the outcome in report.
+    static bool checkWarmStart(std::string& report) {
+        std::filesystem::path directory = appDataDirectory() / "tmp";
+        std::error_code ec;
+        std::filesystem::create_directories(directory, ec);
+        std::filesystem::path script = directory / "warm_check.js";
+        writeFileIfChanged(script, "console.log('warm');\n");
+
+        ProgramRun run;
+        if (!runWarm(toUtf8(script.wstring()), 0, run) || !run.passed || run.output.find("warm") == std::string::npos) {
+            report = "script did not run in a warm worker";
+            return false;
+        }
+        if (workerCommand().find("--snapshot-blob") == std::string::npos) {
+            report = "ran warm, but no startup snapshot was built (needs Node 18.20 or later)";
+            return false;
+        }
+        report = "ran in a warm worker started from a startup snapshot";
+        return true;
+    }
+
+protected:
+    std::set<std::string> runDependencies(const PreparedProgram& program) override {
+        return importClosure(std::filesystem::path(toWide(program.sourcePath)), scanJavaScriptImports);
+    }
+
+private:
+    struct CacheState {
+        size_t entries = 0;
+        std::filesystem::file_time_type newest;
+
+        bool operator==(const CacheState& other) const {
+            return entries == other.entries && newest == other.newest;
+        }
+    };
+
+    // Node's compile cache (Node 22.1 and later) persists V8 code cache data for the script
+    // and everything it requires, keyed by content hash, so unchanged code is not re-parsed
+    // or recompiled. It is enabled for every node child through the inherited environment.
+    static std::filesystem::path compileCacheDirectory() {
+        static const std::filesystem::path directory = [] {
+            std::filesystem::path cache = appDataDirectory() / "node_compile_cache";
+            std::error_code ec;
+            std::filesystem::create_directories(cache, ec);
+            SetEnvironmentVariableW(L"NODE_COMPILE_CACHE", cache.wstring().c_str());
+            std::thread(trimDirectory, cache, NODE_COMPILE_CACHE_LIMIT_MB * 1024 * 1024).detach();
+            return cache;
+        }();
+        return directory;
+    }
+
+    // Runs the script in a pre-started worker. Returns false when workers are disabled with
+    // CODEVALIDATOR_NODE_WARM=0, cannot start, or hand the script back for a full syntax check.
+    static bool runWarm(const std::string& filePath, uintmax_t memoryLimitMB, ProgramRun& run) {
+        static const bool enabled = readEnvironment(L"CODEVALIDATOR_NODE_WARM", "1") != "0";
+        if (!enabled || StartupProfiles::isTuning()) {
+            return false;
+        }
+
+        // Resolved first: on first use it builds the startup snapshot through a command of its own
+        WarmInterpreterPool& pool = WarmInterpreterPool::forCommand(workerCommand());
+        AdmissionControl::Ticket admission;
+        std::unique_ptr<ChildProcess> worker = pool.acquire();
+        if (!worker) {
+            return false;
+        }
+        worker->setMemoryLimit(memoryLimitMB);
+        CancellationGroup::Member member(worker->job());
+        BackgroundPause::Pausable pausable(worker->job());
+        if (!worker->writeInput(filePath + "\n")) {
+            return false;
+        }
+        worker->closeInput();
+        std::string output = worker->readOutput();
+        if (output.rfind(NODE_RUN_MARKER, 0) != 0) {
+            return false;
+        }
+        run.output = "Execution output:\n" + output.substr(std::strlen(NODE_RUN_MARKER));
+        run.passed = worker->exitCode() == 0;
+        run.complete = !CancellationGroup::currentCancelled();
+        return true;
+    }
+
+    // Command line for a warm worker. Workers start from a startup snapshot of the bootstrap
+    // when this node can build one (Node 18.20 and later), which skips loading the bootstrap
+    // and its modules on every spawn. Snapshots are tied to the node binary, the bootstrap
+    // and the profile flags, and are rebuilt whenever one of them changes.
+    static std::string workerCommand() {
+        std::string nodeCommand = StartupProfiles::instance().command("node");
+        std::string snapshotName = toHex(fnv1a64(nodeCommand, fnv1a64(NODE_BOOTSTRAP, fnv1a64(executableFingerprint("node"))))) + ".blob";
+
+        static std::mutex snapshotMutex;
+        static std::map<std::string, std::string> commands;
+        std::lock_guard<std::mutex> lock(snapshotMutex);
+        auto& command = commands[snapshotName];
+        if (!command.empty()) {
+            return command;
+        }
+
+        std::filesystem::path directory = appDataDirectory() / "node_snapshot";
+        std::error_code ec;
+        std::filesystem::create_directories(directory, ec);
+        std::filesystem::path bootstrap = directory / "bootstrap.js";
+        writeFileIfChanged(bootstrap, NODE_BOOTSTRAP);
+
+        std::filesystem::path snapshot = directory / snapshotName;
+        if (!std::filesystem::exists(snapshot)) {
+            for (const auto& entry : std::filesystem::directory_iterator(directory, ec)) {
+                if (entry.path().extension() == ".blob") {
+                    std::filesystem::remove(entry.path(), ec);
+                }
+            }
+            runShellCommand(nodeCommand + "--snapshot-blob " + quoteArgument(toUtf8(snapshot.wstring()))
+                + " --build-snapshot " + quoteArgument(toUtf8(bootstrap.wstring())) + " 2>&1");
+        }
+
+        if (std::filesystem::exists(snapshot)) {
+            command = nodeCommand + "--snapshot-blob " + quoteArgument(toUtf8(snapshot.wstring()));
+        }
+        else {
+            command = nodeCommand + quoteArgument(toUtf8(bootstrap.wstring()));
+        }
+        return command;
+    }
+
+    static CacheState readCacheState(const std::filesystem::path& directory) {
+        CacheState state;
+        std::error_code ec;
+        for (auto it = std::filesystem::recursive_directory_iterator(directory, ec); !ec && it != std::filesystem::recursive_directory_iterator(); it.increment(ec)) {
+            if (it->is_regular_file(ec)) {
+                state.entries++;
+                state.newest = std::max(state.newest, it->last_write_time(ec));
+            }
+        }
+        return state;
+    }
+};
+
+std::unique_ptr<LanguageValidator> getValidator(const std::string& language, const std::string& filePath) {
+    if (language == "Auto-detect") {
+        std::filesystem::path path(filePath);
+        std::string extension = path.extension().string();
+
+        if (extension == ".java") return std::make_unique<JavaValidator>();
+        if (extension == ".py") return std::make_unique<PythonValidator>();
+        if (extension == ".php") return std::make_unique<PHPValidator>();
+        if (extension == ".js") return std::make_unique<JavaScriptValidator>();
+
+        return nullptr;
+    }
+    else if (language == "Java") return std::make_unique<JavaValidator>();
+    else if (language == "Python") return std::make_unique<PythonValidator>();
+    else if (language == "PHP") return std::make_unique<PHPValidator>();
+    else if (language == "JavaScript") return std::make_unique<JavaScriptValidator>();
+
+    return nullptr;
+}
+
+// Runs the checks shared by the GUI and the daemon before handing the file to a validator
+std::string guardValidation(LanguageValidator* validator, const std::string& filePath, const std::function<std::string()>& validate) {
+    try {
+        if (filePath.empty()) {
+            return "Please select a file to validate.";
+        }
+        if (!std::filesystem::exists(filePath)) {
+            return "File does not exist: " + filePath;
+        }
+        if (!validator) {
+            return "Unsupported file type or language selection.";
+        }
+        if (!validator->isCompatible(filePath)) {
+            return "Selected language doesn't match the file extension.";
+        }
+        return validate();
+    }
+    catch (const std::exception& e) {
+        return "Error occurred during validation: " + std::string(e.what());
+    }
+    catch (...) {
+        return "Unknown error occurred during validation.";
+    }
+}
+
+std::string validateFile(LanguageValidator* validator, const std::string& filePath, const RunOptions& options = {}, bool* passed = nullptr) {
+    if (passed) {
+        *passed = false;
+    }
+    return guardValidation(validator, filePath, [&]() { return validator->validate(filePath, options, passed); });
+}
+
+std::vector<std::string> getCommandLineArgs() {
+    std::vector<std::string> args;
+    int argc = 0;
+    LPWSTR* argv = CommandLineToArgvW(GetCommandLineW(), &argc);
+    if (!argv) {
+        return args;
+    }
+    for (int i = 1; i < argc; ++i) {
+        args.push_back(toUtf8(argv[i]));
+    }
+    LocalFree(argv);
+    return args;
+}
+
+// Daemon wire protocol. Every frame is [uint32 length][uint32 requestId][uint8 type][payload],
+// where length counts the id, the type and the payload. A Validate payload is
+// "path\0language\0options" with options written as key=value pairs separated by ';'.
+// Each request is answered by zero or more ResultChunk frames and one ResultEnd frame
+// carrying its id, so clients can pipeline requests and receive results out of order.
+// Clients that send the option shm=1 may instead get one ResultShared frame for large
+// results: its payload is [uint64 section handle][uint64 size], where the handle is a
+// read-only file mapping already duplicated into the client process.
+enum class FrameType : uint8_t {
+    Validate = 1,
+    ResultChunk = 2,
+    ResultEnd = 3,
+    ResultShared = 4,
+    // Coordinator and worker connections
+    WorkRequest = 5,
+    WorkBatch = 6,
+    WorkResult = 7,
+    WorkRevoke = 8,
+    WorkDone = 9,
+};
+
+struct Frame {
+    uint32_t requestId = 0;
+    FrameType type = FrameType::Validate;
+    std::string payload;
+};
+
+constexpr uint32_t MAX_FRAME_SIZE = 64 * 1024 * 1024;
+constexpr size_t RESULT_CHUNK_SIZE = 64 * 1024;
+constexpr size_t SHARED_RESULT_THRESHOLD = 1024 * 1024;
+
+// Reads or writes exactly size bytes on a handle opened with FILE_FLAG_OVERLAPPED.
+// Overlapped I/O lets one thread block in ReadFile while others write responses.
+bool transferAll(HANDLE handle, char* data, DWORD size, bool writing) {
+    HandleGuard event(CreateEventW(nullptr, TRUE, FALSE, nullptr), CloseHandle);
+    if (!event) {
+        return false;
+    }
+
+    while (size > 0) {
+        OVERLAPPED overlapped{};
+        overlapped.hEvent = event.get();
+        BOOL ok = writing ? WriteFile(handle, data, size, nullptr, &overlapped)
+                          : ReadFile(handle, data, size, nullptr, &overlapped);
+        if (!ok && GetLastError() != ERROR_IO_PENDING) {
+            return false;
+        }
+
+        DWORD transferred = 0;
+        if (!GetOverlappedResult(handle, &overlapped, &transferred, TRUE) || transferred == 0) {
+            return false;
+        }
+        data += transferred;
+        size -= transferred;
+    }
+    return true;
+}
+
+bool readFrame(HANDLE pipe, Frame& frame) {
+    char header[9];
+    if (!transferAll(pipe, header, sizeof(header), false)) {
+        return false;
+    }
+
+    uint32_t length = 0;
+    std::memcpy(&length, header, 4);
+    std::memcpy(&frame.requestId, header + 4, 4);
+    frame.type = static_cast<FrameType>(header[8]);
+    if (length < 5 || length > MAX_FRAME_SIZE) {
+        return false;
+    }
+
+    frame.payload.resize(length - 5);
+    return frame.payload.empty() || transferAll(pipe, &frame.payload[0], static_cast<DWORD>(frame.payload.size()), false);
+}
+
+bool writeFrame(HANDLE pipe, const Frame& frame) {
+    uint32_t length = static_cast<uint32_t>(frame.payload.size() + 5);
+    std::string buffer(9, '\0');
+    std::memcpy(&buffer[0], &length, 4);
+    std::memcpy(&buffer[4], &frame.requestId, 4);
+    buffer[8] = static_cast<char>(frame.type);
+    buffer += frame.payload;
+    return transferAll(pipe, &buffer[0], static_cast<DWORD>(buffer.size()), true);
+}
+
+struct ValidationRequest {
+    std::string filePath;
+    std::string language = "Auto-detect";
+    std::map<std::string, std::string> options;
+
+    std::string option(const std::string& key, const std::string& fallback = "") const {
+        auto it = options.find(key);
+        return it != options.end() ? it->second : fallback;
+    }
+};
+
+// Run settings carried in a request's options (expected=<path>, input=<path>)
+RunOptions runOptionsFor(const ValidationRequest& request) {
+    RunOptions options;
+    options.expectedOutputPath = request.option("expected");
+    options.inputPath = request.option("input");
+    options.deterministic = request.option("deterministic") == "1";
+    options.useRunCache = request.option("cache", "1") != "0";
+    return options;
+}
+
+std::map<std::string, std::string> parseOptions(const std::string& text) {
+    std::map<std::string, std::string> options;
+    std::stringstream stream(text);
+    std::string pair;
+    while (std::getline(stream, pair, ';')) {
+        size_t eq = pair.find('=');
+        if (eq != std::string::npos) {
+            options[pair.substr(0, eq)] = pair.substr(eq + 1);
+        }
+        else if (!pair.empty()) {
+            options[pair] = "1";
+        }
+    }
+    return options;
+}
+
+std::string formatOptions(const std::map<std::string, std::string>& options) {
+    std::string text;
+    for (const auto& [key, value] : options) {
+        if (!text.empty()) {
+            text += ';';
+        }
+        text += key + "=" + value;
+    }
+    return text;
+}
+
+ValidationRequest parseValidateRequest(const std::string& payload) {
+    std::vector<std::string> fields;
+    size_t start = 0;
+    while (fields.size() < 2) {
+        size_t end = payload.find('\0', start);
+        if (end == std::string::npos) {
+            break;
+        }
+        fields.push_back(payload.substr(start, end - start));
+        start = end + 1;
+    }
+
+    ValidationRequest request;
+    if (fields.size() == 2) {
+        request.filePath = fields[0];
+        if (!fields[1].empty()) {
+            request.language = fields[1];
+        }
+        request.options = parseOptions(payload.substr(start));
+    }
+    else {
+        request.filePath = payload.substr(0, payload.find('\0'));
+    }
+    return request;
+}
+
+std::string buildValidatePayload(const ValidationRequest& request) {
+    std::string payload = request.filePath;
+    payload += '\0';
+    payload += request.language;
+    payload += '\0';
+    payload += formatOptions(request.options);
+    return payload;
+}
+
+// Keeps one validator per language alive so the daemon does not rebuild them per request
+class ValidatorRegistry {
+public:
+    LanguageValidator* get(const std::string& language, const std::string& filePath) {
+        std::string key = language;
+        if (language == "Auto-detect") {
+            key = std::filesystem::path(filePath).extension().string();
+        }
+
+        std::lock_guard<std::mutex> lock(m_mutex);
+        auto it = m_validators.find(key);
+        if (it == m_validators.end()) {
+            it = m_validators.emplace(key, getValidator(language, filePath)).first;
+        }
+        return it->second.get();
+    }
+
+private:
+    std::mutex m_mutex;
+    std::map<std::string, std::unique_ptr<LanguageValidator>> m_validators;
+};
+
+// Number of files whose results the daemon keeps in memory
+constexpr size_t RESULT_CACHE_ENTRIES = 1024;
+
+// Results keyed by file identity. Only syntax and compilation failures are cached:
+// they depend on the file contents alone, while execution output may change between runs.
+// Packaged Java files are the exception, since they are compiled with the rest of their
+// source tree and can fail because of another file, so they get no key. Each file keeps
+// only the result for its latest version, and the least recently used file is dropped
+// once RESULT_CACHE_ENTRIES are held.
+class ResultCache {
+public:
+    static std::string makeKey(const ValidationRequest& request) {
+        std::filesystem::path file(toWide(request.filePath));
+        std::filesystem::path root;
+        if (file.extension() == ".java" && javaSourceRoot(std::filesystem::absolute(file).parent_path(), scanJavaSource(readFileContents(file)).packageName, root)) {
+            return "";
+        }
+        std::error_code ec;
+        auto size = std::filesystem::file_size(request.filePath, ec);
+        auto modified = std::filesystem::last_write_time(request.filePath, ec).time_since_epoch().count();
+        if (ec) {
+            return "";
+        }
+        return request.language + "|" + request.filePath + "|" + std::to_string(size) + "|" + std::to_string(modified);
+    }
+
+    // Diagnostics from the compiler or syntax checker itself. A checker that could not be
+    // started or was killed reports under the same heading, but would pass on a retry.
+    static bool isCacheable(const std::string& result) {
+        if (result.rfind("Syntax errors:", 0) != 0 && result.rfind("Compilation errors:", 0) != 0) {
+            return false;
+        }
+        for (const char* transient : { "Error executing command: ", "is not recognized as an internal or external command", "Killed: " }) {
+            if (result.find(transient) != std::string::npos) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    bool lookup(const std::string& key, std::string& result) {
+        if (key.empty()) {
+            return false;
+        }
+        std::lock_guard<std::mutex> lock(m_mutex);
+        auto it = m_results.find(identityOf(key));
+        if (it == m_results.end()) {
+            return false;
+        }
+        // The file has changed since, so its old result is no use any more
+        if (it->second.key != key) {
+            m_results.erase(it);
+            return false;
+        }
+        it->second.lastUse = ++m_uses;
+        result = it->second.result;
+        return true;
+    }
+
+    void store(const std::string& key, const std::string& result) {
+        if (key.empty() || !isCacheable(result)) {
+            return;
+        }
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_results[identityOf(key)] = { key, result, ++m_uses };
+        if (m_results.size() > RESULT_CACHE_ENTRIES) {
+            auto oldest = std::min_element(m_results.begin(), m_results.end(),
+                [](const auto& a, const auto& b) { return a.second.lastUse < b.second.lastUse; });
+            m_results.erase(oldest);
+        }
+    }
+
+private:
+    struct Entry {
+        std::string key;
+        std::string result;
+        uint64_t lastUse = 0;
+    };
+
+    // Language and path, without the size and modification time that make up the version
+    static std::string identityOf(const std::string& key) {
+        size_t modified = key.rfind('|');
+        return key.substr(0, key.rfind('|', modified - 1));
+    }
+
+    std::mutex m_mutex;
+    std::map<std::string, Entry> m_results;
+    uint64_t m_uses = 0;
+};
+
+// Worker threads fed from two FIFO queues, interactive and background. Interactive jobs
+// run first, and one extra worker takes only interactive jobs.
+class ValidationEngine {
+public:
+    explicit ValidationEngine(unsigned workerCount) {
+        workerCount = std::max(1u, workerCount);
+        for (unsigned i = 0; i < workerCount; ++i) {
+            m_workers.emplace_back(&ValidationEngine::workerLoop, this, false);
+        }
+        // Reserved for interactive work, so it never waits for a busy batch to drain
+        m_workers.emplace_back(&ValidationEngine::workerLoop, this, true);
+    }
+
+    ~ValidationEngine() {
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_stopping = true;
+        }
+        m_wake.notify_all();
+        for (auto& worker : m_workers) {
+            worker.join();
+        }
+    }
+
+    // Interactive jobs go ahead of every queued background job. Jobs submitted from a job
+    // take its priority by default.
+    void submit(std::function<void()> job, Priority priority = t_priority) {
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            (priority == Priority::Interactive ? m_interactive : m_background).push_back(std::move(job));
+        }
+        // The reserved worker may be the only one waiting, and it takes interactive jobs only
+        m_wake.notify_all();
+    }
+
+private:
+    void workerLoop(bool interactiveOnly) {
+        for (;;) {
+            std::function<void()> job;
+            Priority priority = Priority::Interactive;
+            {
+                std::unique_lock<std::mutex> lock(m_mutex);
+                m_wake.wait(lock, [&] { return m_stopping || !m_interactive.empty() || (!interactiveOnly && !m_background.empty()); });
+                std::deque<std::function<void()>>* queue = &m_interactive;
+                if (m_interactive.empty()) {
+                    if (interactiveOnly || m_background.empty()) {
+                        return;
+                    }
+                    queue = &m_background;
+                    priority = Priority::Background;
+                }
+                job = std::move(queue->front());
+                queue->pop_front();
+            }
+
+            t_priority = priority;
+            if (priority == Priority::Interactive) {
+                BackgroundPause::Scope pause;
+                job();
+            }
+            else {
+                job();
+            }
+        }
+    }
+
+    std::mutex m_mutex;
+    std::condition_variable m_wake;
+    std::deque<std::function<void()>> m_interactive;
+    std::deque<std::function<void()>> m_background;
+    std::vector<std::thread> m_workers;
+    bool m_stopping = false;
+};
+
+// One input case of a multi-case run: <name>.in, compared with <name>.out when that exists
+struct TestCase {
+    std::string name;
+    RunOptions options;
+};
+
+std::vector<TestCase> collectTestCases(const std::filesystem::path& directory) {
+    std::vector<TestCase> cases;
+    std::error_code ec;
+    for (const auto& entry : std::filesystem::directory_iterator(directory, ec)) {
+        if (!entry.is_regular_file(ec) || entry.path().extension() != ".in") {
+            continue;
+        }
+        TestCase testCase;
+        testCase.name = toUtf8(entry.path().filename().wstring());
+        testCase.options.inputPath = toUtf8(entry.path().wstring());
+        std::filesystem::path expected = entry.path();
+        expected.replace_extension(".out");
+        if (std::filesystem::is_regular_file(expected, ec)) {
+            testCase.options.expectedOutputPath = toUtf8(expected.wstring());
+        }
+        cases.push_back(std::move(testCase));
+    }
+    std::sort(cases.begin(), cases.end(), [](const TestCase& a, const TestCase& b) { return a.name < b.name; });
+    return cases;
+}
+
+// Checks a file once, then runs the result against every case in a directory on the engine's
+// workers. The calling thread runs cases as well, so this may itself be called on a worker
+// without deadlocking on the queue. With cancelOnFailure, cases that have not started yet
+// are skipped once one fails. `allPassed` is set when every case passed.
+std::string validateCases(LanguageValidator* validator, const std::string& filePath, const std::string& casesDirectory,
+    bool cancelOnFailure, ValidationEngine& engine, bool* allPassed = nullptr) {
+    if (allPassed) {
+        *allPassed = false;
+    }
+    return guardValidation(validator, filePath, [&]() -> std::string {
+        std::vector<TestCase> cases = collectTestCases(std::filesystem::path(toWide(casesDirectory)));
+        if (cases.empty()) {
+            return "No test cases (*.in) found in " + casesDirectory;
+        }
+
+        PreparedProgram program = validator->prepare(filePath);
+        if (!program.failure.empty()) {
+            return program.failure;
+        }
+
+        struct CaseResult {
+            bool ran = false;
+            bool passed = false;
+            double milliseconds = 0;
+            std::string output;
+        };
+        // Shared with helpers that may only start after this call returned
+        struct CaseRun {
+            std::vector<TestCase> cases;
+            std::vector<CaseResult> results;
+            std::atomic<size_t> next{ 0 };
+            std::atomic<bool> cancelled{ false };
+            std::mutex mutex;
+            std::condition_variable done;
+            size_t finished = 0;
+        };
+        auto run = std::make_shared<CaseRun>();
+        run->cases = std::move(cases);
+        run->results.resize(run->cases.size());
+
+        // Each case reports its own verdict instead of the check phase's header
+        PreparedProgram caseProgram = program;
+        caseProgram.header.clear();
+        // Helpers work for the same batch as the caller
+        auto runCases = [run, validator, caseProgram, cancelOnFailure, group = t_cancellation]() {
+            CancellationGroup::Scope scope(group);
+            for (;;) {
+                size_t index = run->next++;
+                if (index >= run->cases.size()) {
+                    return;
+                }
+                CaseResult& result = run->results[index];
+                if (!run->cancelled) {
+                    auto start = std::chrono::steady_clock::now();
+                    result.output = validator->runProgram(caseProgram, run->cases[index].options, &result.passed);
+                    result.milliseconds = ValidationTimings::millisecondsSince(start);
+                    result.ran = true;
+                    if (!result.passed && cancelOnFailure) {
+                        run->cancelled = true;
+                    }
+                }
+                std::lock_guard<std::mutex> lock(run->mutex);
+                if (++run->finished == run->cases.size()) {
+                    run->done.notify_all();
+                }
+            }
+        };
+
+        size_t helpers = std::min<size_t>(run->cases.size(), std::max(1u, std::thread::hardware_concurrency())) - 1;
+        for (size_t i = 0; i < helpers; ++i) {
+            engine.submit(runCases);
+        }
+        runCases();
+        {
+            std::unique_lock<std::mutex> lock(run->mutex);
+            run->done.wait(lock, [&] { return run->finished == run->cases.size(); });
+        }
+
+        size_t passed = 0;
+        size_t failed = 0;
+        std::string details;
+        for (size_t i = 0; i < run->cases.size(); ++i) {
+            const CaseResult& result = run->results[i];
+            details += "== " + run->cases[i].name + ": ";
+            if (!result.ran) {
+                details += "skipped\n";
+                continue;
+            }
+            (result.passed ? passed : failed)++;
+            details += std::string(result.passed ? "passed" : "failed") + " (" + std::to_string(static_cast<int>(result.milliseconds)) + " ms)\n" + result.output;
+            if (!details.empty() && details.back() != '\n') {
+                details += '\n';
+            }
+        }
+
+        std::string summary = "Cases: " + std::to_string(passed) + " passed, " + std::to_string(failed) + " failed, "
+            + std::to_string(run->cases.size() - passed - failed) + " skipped\n";
+        if (allPassed) {
+            *allPassed = passed == run->cases.size();
+        }
+        return (passed == run->cases.size() ? program.header : "Test cases failed:\n") + summary + details;
+    });
+}
+
+// Validates a request's file, as a multi-case run when it names a cases directory
+std::string runValidationRequest(LanguageValidator* validator, const ValidationRequest& request, ValidationEngine& engine, bool* passed = nullptr) {
+    std::string casesDirectory = request.option("cases");
+    if (!casesDirectory.empty()) {
+        return validateCases(validator, request.filePath, casesDirectory, request.option("failfast") == "1", engine, passed);
+    }
+    return validateFile(validator, request.filePath, runOptionsFor(request), passed);
+}
+
+// Long-running process that keeps validators, cached results and worker threads warm
+// and serves validate requests over DAEMON_PIPE_NAME.
+class ValidationDaemon {
+public:
+    ValidationDaemon() : m_engine(std::thread::hardware_concurrency()) {}
+
+    int run() {
+        bool firstInstance = true;
+        for (;;) {
+            DWORD openMode = PIPE_ACCESS_DUPLEX | FILE_FLAG_OVERLAPPED;
+            if (firstInstance) {
+                openMode |= FILE_FLAG_FIRST_PIPE_INSTANCE;
+            }
+            HANDLE pipe = CreateNamedPipeW(DAEMON_PIPE_NAME, openMode,
+                PIPE_TYPE_BYTE | PIPE_READMODE_BYTE | PIPE_WAIT | PIPE_REJECT_REMOTE_CLIENTS,
+                PIPE_UNLIMITED_INSTANCES, 64 * 1024, 64 * 1024, 0, nullptr);
+            if (pipe == INVALID_HANDLE_VALUE) {
+                // Another daemon already owns the pipe name
+                return 1;
+            }
+            firstInstance = false;
+
+            if (!waitForClient(pipe)) {
+                CloseHandle(pipe);
+                continue;
+            }
+            std::thread(&ValidationDaemon::serveClient, this, std::make_shared<Connection>(pipe)).detach();
+        }
+    }
+
+private:
+    struct Connection {
+        explicit Connection(HANDLE handle) : pipe(handle) {
+            ULONG clientProcessId = 0;
+            if (GetNamedPipeClientProcessId(pipe, &clientProcessId)) {
+                clientProcess = OpenProcess(PROCESS_DUP_HANDLE, FALSE, clientProcessId);
+            }
+        }
+        ~Connection() {
+            if (clientProcess) {
+                CloseHandle(clientProcess);
+            }
+            DisconnectNamedPipe(pipe);
+            CloseHandle(pipe);
+        }
+
+        bool send(const Frame& frame) {
+            std::lock_guard<std::mutex> lock(writeMutex);
+            return writeFrame(pipe, frame);
+        }
+
+        HANDLE pipe;
+        HANDLE clientProcess = nullptr;
+        std::mutex writeMutex;
+    };
+
+    static bool waitForClient(HANDLE pipe) {
+        HandleGuard event(CreateEventW(nullptr, TRUE, FALSE, nullptr), CloseHandle);
+        OVERLAPPED overlapped{};
+        overlapped.hEvent = event.get();
+        if (ConnectNamedPipe(pipe, &overlapped)) {
+            return true;
+        }
+
+        DWORD error = GetLastError();
+        if (error == ERROR_PIPE_CONNECTED) {
+            return true;
+        }
+        DWORD ignored = 0;
+        return error == ERROR_IO_PENDING && GetOverlappedResult(pipe, &overlapped, &ignored, TRUE);
+    }
+
+    void serveClient(std::shared_ptr<Connection> connection) {
+        Frame frame;
+        while (readFrame(connection->pipe, frame)) {
+            if (frame.type != FrameType::Validate) {
+                continue;
+            }
+
+            uint32_t requestId = frame.requestId;
+            ValidationRequest request = parseValidateRequest(frame.payload);
+            // Requests are interactive unless the client marks them priority=background
+            Priority priority = request.option("priority") == "background" ? Priority::Background : Priority::Interactive;
+            m_engine.submit([this, connection, requestId, request]() {
+                std::string result = handleRequest(request);
+                if (request.option("shm") != "1" || !shareResult(*connection, requestId, result)) {
+                    streamResult(*connection, requestId, result);
+                }
+            }, priority);
+        }
+    }
+
+    std::string handleRequest(const ValidationRequest& request) {
+        bool useCache = request.option("cache", "1") != "0";
+        std::string key = useCache ? ResultCache::makeKey(request) : "";
+        std::string result;
+        if (m_cache.lookup(key, result)) {
+            return result;
+        }
+
+        result = runValidationRequest(m_registry.get(request.language, request.filePath), request, m_engine);
+        m_cache.store(key, result);
+        return result;
+    }
+
+    // Hands a large result to the client as a shared section so only the handle crosses the pipe
+    static bool shareResult(Connection& connection, uint32_t requestId, const std::string& result) {
+        if (result.size() < SHARED_RESULT_THRESHOLD || !connection.clientProcess) {
+            return false;
+        }
+
+        uint64_t size = result.size();
+        HandleGuard section(CreateFileMappingW(INVALID_HANDLE_VALUE, nullptr, PAGE_READWRITE,
+            static_cast<DWORD>(size >> 32), static_cast<DWORD>(size), nullptr), CloseHandle);
+        if (!section) {
+            return false;
+        }
+
+        void* view = MapViewOfFile(section.get(), FILE_MAP_WRITE, 0, 0, 0);
+        if (!view) {
+            return false;
+        }
+        std::memcpy(view, result.data(), result.size());
+        UnmapViewOfFile(view);
+
+        HANDLE remoteSection = nullptr;
+        if (!DuplicateHandle(GetCurrentProcess(), section.get(), connection.clientProcess,
+            &remoteSection, FILE_MAP_READ, FALSE, 0)) {
+            return false;
+        }
+
+        std::string payload(16, '\0');
+        uint64_t handleValue = reinterpret_cast<uintptr_t>(remoteSection);
+        std::memcpy(&payload[0], &handleValue, 8);
+        std::memcpy(&payload[8], &size, 8);
+        if (!connection.send({ requestId, FrameType::ResultShared, payload })) {
+            // The client never learns about the handle, so close it on its behalf
+            DuplicateHandle(connection.clientProcess, remoteSection, nullptr, nullptr, 0, FALSE, DUPLICATE_CLOSE_SOURCE);
+            return true;
+        }
+        connection.send({ requestId, FrameType::ResultEnd, "" });
+        return true;
+    }
+
+    static void streamResult(Connection& connection, uint32_t requestId, const std::string& result) {
+        for (size_t offset = 0; offset < result.size(); offset += RESULT_CHUNK_SIZE) {
+            if (!connection.send({ requestId, FrameType::ResultChunk, result.substr(offset, RESULT_CHUNK_SIZE) })) {
+                return;
+            }
+        }
+        connection.send({ requestId, FrameType::ResultEnd, "" });
+    }
+
+    ValidatorRegistry m_registry;
+    ResultCache m_cache;
+    ValidationEngine m_engine;
+};
+
+// Result text received from the daemon. Small results are copied out of chunk frames;
+// large ones stay in the shared section the daemon handed over and are read in place.
+class DaemonResult {
+public:
+    DaemonResult() = default;
+    DaemonResult(const DaemonResult&) = delete;
+    DaemonResult& operator=(const DaemonResult&) = delete;
+
+    ~DaemonResult() {
+        reset();
+    }
+
+    std::string_view text() const {
+        return m_view ? std::string_view(m_view, m_size) : std::string_view(m_buffer);
+    }
+
+    void append(const std::string& chunk) {
+        m_buffer += chunk;
+    }
+
+    bool mapSection(HANDLE section, size_t size) {
+        reset();
+        m_section = section;
+        m_view = static_cast<const char*>(MapViewOfFile(section, FILE_MAP_READ, 0, 0, 0));
+        m_size = size;
+        return m_view != nullptr;
+    }
+
+    void reset() {
+        if (m_view) {
+            UnmapViewOfFile(m_view);
+            m_view = nullptr;
+        }
+        if (m_section) {
+            CloseHandle(m_section);
+            m_section = nullptr;
+        }
+        m_buffer.clear();
+        m_size = 0;
+    }
+
+private:
+    std::string m_buffer;
+    HANDLE m_section = nullptr;
+    const char* m_view = nullptr;
+    size_t m_size = 0;
+};
+
+// Sends one request to a running daemon. Returns false when no daemon is listening
+// or the connection drops, so callers can fall back to validating in-process.
+bool requestFromDaemon(const ValidationRequest& request, DaemonResult& result) {
+    HandleGuard pipe(CreateFileW(DAEMON_PIPE_NAME, GENERIC_READ | GENERIC_WRITE, 0, nullptr,
+        OPEN_EXISTING, FILE_FLAG_OVERLAPPED, nullptr), CloseHandle);
+    if (pipe.get() == INVALID_HANDLE_VALUE) {
+        pipe.release();
+        return false;
+    }
+
+    if (!writeFrame(pipe.get(), { 1, FrameType::Validate, buildValidatePayload(request) })) {
+        return false;
+    }
+
+    result.reset();
+    Frame frame;
+    while (readFrame(pipe.get(), frame)) {
+        if (frame.type == FrameType::ResultChunk) {
+            result.append(frame.payload);
+        }
+        else if (frame.type == FrameType::ResultShared && frame.payload.size() == 16) {
+            uint64_t handleValue = 0;
+            uint64_t size = 0;
+            std::memcpy(&handleValue, &frame.payload[0], 8);
+            std::memcpy(&size, &frame.payload[8], 8);
+            if (!result.mapSection(reinterpret_cast<HANDLE>(static_cast<uintptr_t>(handleValue)), static_cast<size_t>(size))) {
+                return false;
+            }
+        }
+        else if (frame.type == FrameType::ResultEnd) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// GUI-subsystem builds have no console of their own; headless modes print to the one they were started from
+void attachParentConsole() {
+    if (AttachConsole(ATTACH_PARENT_PROCESS)) {
+        FILE* stream = nullptr;
+        freopen_s(&stream, "CONOUT$", "w", stdout);
+        freopen_s(&stream, "CONOUT$", "w", stderr);
+    }
+}
+
+// Median wall time of several runs of a command, in milliseconds
+double measureCommand(const std::string& command, int runs = 5) {
+    std::vector<double> timings;
+    for (int i = 0; i < runs; ++i) {
+        auto start = std::chrono::steady_clock::now();
+        runShellCommand(command);
+        timings.push_back(std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count());
+    }
+    std::sort(timings.begin(), timings.end());
+    return timings[timings.size() / 2];
+}
+
+void reportStartup(const std::string& label, double baseline, double tuned) {
+    std::cout << label << ": " << static_cast<int>(baseline) << " ms -> " << static_cast<int>(tuned) << " ms ("
+        << static_cast<int>(baseline - tuned) << " ms saved)\n";
+}
+
+struct StartupCandidates {
+    std::string runtime;
+    std::string language;
+    std::string timingProgram;
+    std::vector<std::string> flagSets;
+};
+
+// Small programs whose verdicts must not change under a candidate profile: one that runs
+// cleanly, one with a syntax error and one that fails at run time for each runtime
+const std::vector<std::pair<std::string, std::string>> STARTUP_CORPUS = {
+    { "ok.py", "import json\nprint(json.dumps({'ok': [1, 2, 3]}))\n" },
+    { "syntax.py", "def broken(:\n    pass\n" },
+    { "failure.py", "raise ValueError('boom')\n" },
+    { "ok.php", "<?php\necho json_encode([1, 2, 3]), \"\\n\";\n" },
+    { "syntax.php", "<?php\necho \"unterminated\"\n" },
+    { "failure.php", "<?php\nthrow new Exception('boom');\n" },
+    { "ok.js", "console.log(JSON.stringify({ ok: [1, 2, 3] }));\n" },
+    { "syntax.js", "function broken( {\n" },
+    { "failure.js", "throw new Error('boom');\n" },
+    { "Hello.java", "public class Hello {\n    public static void main(String[] args) {\n        System.out.println(java.util.List.of(1, 2, 3));\n    }\n}\n" },
+    { "Broken.java", "public class Broken {\n    void broken( {\n}\n" },
+    { "Failure.java", "public class Failure {\n    public static void main(String[] args) {\n        throw new IllegalStateException(\"boom\");\n    }\n}\n" },
+};
+
+std::string StartupProfiles::corpusVerdicts(const std::string& runtime, const std::string& flags, const std::vector<std::filesystem::path>& corpus) {
+    std::map<std::string, std::string> candidate = { { runtime, flags } };
+    t_override = &candidate;
+    std::string verdicts;
+    for (const auto& file : corpus) {
+        std::string filePath = toUtf8(file.wstring());
+        auto validator = getValidator("Auto-detect", filePath);
+        verdicts += validateFile(validator.get(), filePath) + "\n";
+    }
+    t_override = nullptr;
+    return verdicts;
+}
+
+std::vector<std::string> StartupProfiles::tune() {
+    std::lock_guard<std::mutex> tuneLock(m_tuneMutex);
+
+    std::filesystem::path corpusDirectory = appDataDirectory() / "startup_corpus";
+    std::error_code ec;
+    std::filesystem::create_directories(corpusDirectory, ec);
+    for (const auto& [name, content] : STARTUP_CORPUS) {
+        writeFileIfChanged(corpusDirectory / name, content);
+    }
+    std::string corpusPath = quoteArgument(toUtf8(corpusDirectory.wstring()));
+    auto corpusFile = [&](const std::string& name) { return quoteArgument(toUtf8((corpusDirectory / name).wstring())); };
+
+    // Extra files to check verdicts on, e.g. a directory of real submissions
+    std::filesystem::path extraCorpus(toWide(readEnvironment(L"CODEVALIDATOR_PROFILE_CORPUS")));
+
+    // Flags that trim what the runtime loads at start-up, such as python -I, -S, -E or -s and
+    // php -n, are left out: they drop the script's own directory, site-packages, PYTHONPATH
+    // or php.ini extensions, which a small corpus cannot show but real programs rely on
+    const std::vector<StartupCandidates> candidates = {
+        { "python", "Python", corpusFile("ok.py"), {} },
+        { "php", "PHP", corpusFile("ok.php"), {} },
+        { "java", "Java", "-cp " + corpusPath + " Hello", { "-XX:TieredStopAtLevel=1 -XX:+UseSerialGC -Xshare:auto" } },
+        { "node", "JavaScript", corpusFile("ok.js"), { "--max-semi-space-size=16", "--max-semi-space-size=64" } },
+    };
+
+    std::vector<std::string> report;
+    for (const auto& candidate : candidates) {
+        std::string fingerprint = executableFingerprint(candidate.runtime);
+        if (fingerprint.empty()) {
+            report.push_back(candidate.runtime + ": not installed");
+            continue;
+        }
+
+        // Nothing to compare against the baseline, so skip the timing and corpus runs. A profile
+        // stored by an older version that still had flags for this runtime is dropped.
+        if (candidate.flagSets.empty()) {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            load();
+            m_profiles.erase(candidate.runtime);
+            save();
+            report.push_back(candidate.runtime + ": no candidate flags");
+            continue;
+        }
+
+        auto validator = getValidator(candidate.language, "");
+        std::vector<std::filesystem::path> corpus;
+        for (const auto& directory : { corpusDirectory, extraCorpus }) {
+            for (const auto& entry : std::filesystem::directory_iterator(directory, ec)) {
+                if (validator->isCompatible(toUtf8(entry.path().wstring()))) {
+                    corpus.push_back(entry.path());
+                }
+            }
+        }
+
+        // The baseline pass also compiles Hello.java for the timing runs
+        std::string baselineVerdicts = corpusVerdicts(candidate.runtime, "", corpus);
+        double baseline = measureCommand(candidate.runtime + " " + candidate.timingProgram + " 2>&1");
+        double best = baseline;
+        std::string bestFlags;
+        for (const auto& flags : candidate.flagSets) {
+            double timing = measureCommand(candidate.runtime + " " + flags + " " + candidate.timingProgram + " 2>&1");
+            if (timing < best && corpusVerdicts(candidate.runtime, flags, corpus) == baselineVerdicts) {
+                best = timing;
+                bestFlags = flags;
+            }
+        }
+
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            load();
+            m_profiles[candidate.runtime] = { fingerprint, bestFlags };
+            save();
+        }
+        report.push_back(candidate.runtime + ": " + std::to_string(static_cast<int>(baseline)) + " ms -> "
+            + std::to_string(static_cast<int>(best)) + " ms"
+            + (bestFlags.empty() ? " (no faster safe flags)" : " with " + bestFlags));
+    }
+    return report;
+}
+
+// Measures toolchain start-up with and without the optimizations the validators apply
+int runBenchmark() {
+    attachParentConsole();
+
+    std::cout << "Startup profiles:\n";
+    for (const auto& line : StartupProfiles::instance().tune()) {
+        std::cout << "  " << line << "\n";
+    }
+
+    JavaToolchain& java = JavaToolchain::instance();
+    if (!java.waitForArchives()) {
+        std::cout << "java: class data sharing archives unavailable\n";
+        return 1;
+    }
+
+    std::string train = quoteArgument(toUtf8(java.trainingDirectory().wstring()));
+    std::string source = quoteArgument(toUtf8((java.trainingDirectory() / "Hello.java").wstring()));
+    reportStartup("javac (CDS)",
+        measureCommand("javac -d " + train + " " + source + " 2>&1"),
+        measureCommand("javac " + java.javacFlags() + "-d " + train + " " + source + " 2>&1"));
+    reportStartup("java (CDS)",
+        measureCommand("java -cp " + train + " Hello 2>&1"),
+        measureCommand("java " + java.javaFlags() + "-cp " + train + " Hello 2>&1"));
+
+    std::string warmReport;
+    bool warm = JavaScriptValidator::checkWarmStart(warmReport);
+    std::cout << "node warm start: " << warmReport << "\n";
+    return warm ? 0 : 1;
+}
+
+// Dependency graph over one language's files in a tree. Files are rescanned only when their
+// size or timestamp changed; scan results are stored with the tree's other cached state.
+class SourceDependencyIndex {
+public:
+    using Scanner = std::function<std::set<std::string>(const std::filesystem::path& file, const std::filesystem::path& root)>;
+
+    SourceDependencyIndex(std::filesystem::path root, std::string extension, Scanner scanner)
+        : m_root(std::move(root)), m_extension(std::move(extension)), m_scanner(std::move(scanner)) {
+        m_statePath = treeCacheDirectory(m_root) / (m_extension.substr(1) + "_dependencies.txt");
+        load();
+    }
+
+    // Per-user cache directory for state that belongs to one source tree
+    static std::filesystem::path treeCacheDirectory(const std::filesystem::path& root) {
+        std::filesystem::path directory = appDataDirectory() / "cache" / toHex(fnv1a64(fileKey(root)));
+        std::error_code ec;
+        std::filesystem::create_directories(directory, ec);
+        return directory;
+    }
+
+    // Rescans the given files of this index's language, dropping the ones that no longer exist
+    void update(const std::vector<std::filesystem::path>& files) {
+        std::error_code ec;
+        for (const auto& file : files) {
+            if (file.extension() != m_extension) {
+                continue;
+            }
+            std::string key = fileKey(file);
+            if (!std::filesystem::exists(file, ec)) {
+                m_graph.remove(key);
+                m_entries.erase(key);
+                continue;
+            }
+
+            Entry entry;
+            entry.size = std::filesystem::file_size(file, ec);
+            entry.modified = std::filesystem::last_write_time(file, ec).time_since_epoch().count();
+            auto it = m_entries.find(key);
+            if (it != m_entries.end() && it->second.size == entry.size && it->second.modified == entry.modified) {
+                continue;
+            }
+            entry.dependencies = m_scanner(file, m_root);
+            m_graph.setDependencies(key, entry.dependencies);
+            m_entries[key] = std::move(entry);
+        }
+    }
+
+    // The changed files plus every file that imports one of them, directly or transitively
+    std::set<std::string> affectedBy(const std::set<std::string>& changedFiles) const {
+        return m_graph.withDependents(changedFiles);
+    }
+
+    void save() const {
+        std::ofstream file(m_statePath, std::ios::trunc);
+        for (const auto& [key, entry] : m_entries) {
+            file << key << '\t' << entry.size << '\t' << entry.modified << '\t' << joinStrings(entry.dependencies, '|') << '\n';
+        }
+    }
+
+private:
+    struct Entry {
+        uintmax_t size = 0;
+        long long modified = 0;
+        std::set<std::string> dependencies;
+    };
+
+    void load() {
+        std::ifstream file(m_statePath);
+        std::string line;
+        while (std::getline(file, line)) {
+            std::vector<std::string> fields;
+            std::stringstream stream(line);
+            std::string field;
+            while (std::getline(stream, field, '\t')) {
+                fields.push_back(field);
+            }
+            if (fields.size() < 3) {
+                continue;
+            }
+            Entry entry;
+            try {
+                entry.size = std::stoull(fields[1]);
+                entry.modified = std::stoll(fields[2]);
+            }
+            catch (...) {
+                continue;
+            }
+            if (fields.size() > 3) {
+                auto dependencies = splitString(fields[3], '|');
+                entry.dependencies.insert(dependencies.begin(), dependencies.end());
+            }
+            m_graph.setDependencies(fields[0], entry.dependencies);
+            m_entries[fields[0]] = std::move(entry);
+        }
+    }
+
+    std::filesystem::path m_root;
+    std::string m_extension;
+    Scanner m_scanner;
+    std::filesystem::path m_statePath;
+    std::map<std::string, Entry> m_entries;
+    DependencyGraph m_graph;
+};
+
+constexpr unsigned BATCH_MAX_PARALLEL_PER_CPU = 2;
+constexpr uintmax_t CONCURRENCY_LOG_LIMIT_MB = 1;
+
+// Number of validations a batch keeps in flight, tuned from observed throughput. Each window
+// of completions is compared with the previous one: higher throughput adds one more
+// validation, a drop cuts the limit by a quarter, and flat throughput with rising latency
+// takes one away, since the extra validations only queue. After a few steady windows it
+// probes one higher. Decisions are appended to the log file, which is moved to a ".old" file
+// once it passes CONCURRENCY_LOG_LIMIT_MB, and the limit reached is stored with the tree's
+// cached state as the next run's starting point.
+class ConcurrencyController {
+public:
+    ConcurrencyController(const std::filesystem::path& statePath, const std::filesystem::path& logPath, size_t initial, size_t maximum)
+        : m_statePath(statePath), m_logPath(logPath), m_maximum(std::max<size_t>(1, maximum)) {
+        openLog();
+        size_t saved = 0;
+        std::ifstream(m_statePath) >> saved;
+        m_limit = std::clamp<size_t>(saved > 0 ? saved : initial, 1, m_maximum);
+    }
+
+    size_t limit() const {
+        return m_limit;
+    }
+
+    // Records one finished validation and how long it took
+    void completed(double milliseconds) {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        auto now = std::chrono::steady_clock::now();
+        if (m_windowCount == 0) {
+            m_windowStart = m_lastCompletion;
+        }
+        m_lastCompletion = now;
+        m_windowCount++;
+        m_windowLatency += milliseconds;
+
+        // Windows cover at least a second and enough completions to see every slot finish
+        double seconds = std::chrono::duration<double>(now - m_windowStart).count();
+        if (m_windowCount < std::max<size_t>(m_limit, MIN_WINDOW_COMPLETIONS) || seconds < 1.0) {
+            return;
+        }
+        double throughput = m_windowCount / seconds;
+        double latency = m_windowLatency / m_windowCount;
+        adjust(throughput, latency);
+        m_windowCount = 0;
+        m_windowLatency = 0;
+    }
+
+    // Starts timing from now, so idle time between batches is not counted
+    void begin(size_t files) {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        if (logFull()) {
+            m_log.close();
+            openLog();
+        }
+        m_log << "batch of " << files << " files at limit " << m_limit.load() << "\n" << std::flush;
+        m_lastCompletion = std::chrono::steady_clock::now();
+        m_windowCount = 0;
+        m_windowLatency = 0;
+    }
+
+private:
+    // Starts a new log when the current one has grown past the limit, keeping one old log.
+    // Another process may still be writing to it, in which case it is rotated later.
+    void openLog() {
+        if (logFull()) {
+            std::error_code ec;
+            std::filesystem::path old = m_logPath;
+            old += ".old";
+            std::filesystem::rename(m_logPath, old, ec);
+        }
+        m_log.open(m_logPath, std::ios::app);
+    }
+
+    bool logFull() const {
+        std::error_code ec;
+        uintmax_t size = std::filesystem::file_size(m_logPath, ec);
+        return !ec && size >= CONCURRENCY_LOG_LIMIT_MB * 1024 * 1024;
+    }
+
+    void adjust(double throughput, double latency) {
+        size_t previous = m_limit;
+        const char* reason = "first window";
+        if (m_throughput > 0) {
+            if (throughput > m_throughput * 1.05) {
+                m_limit = std::min(m_limit + 1, m_maximum);
+                reason = "throughput rose";
+            }
+            else if (throughput < m_throughput * 0.95) {
+                m_limit = std::max<size_t>(1, m_limit * 3 / 4);
+                reason = "throughput fell";
+            }
+            else if (latency > m_latency * 1.1 && m_limit > 1) {
+                m_limit--;
+                reason = "latency rose at steady throughput";
+            }
+            else if (++m_steadyWindows >= PROBE_AFTER_WINDOWS) {
+                m_limit = std::min(m_limit + 1, m_maximum);
+                reason = "probing";
+            }
+            else {
+                reason = "steady";
+            }
+        }
+        if (m_limit != previous) {
+            m_steadyWindows = 0;
+        }
+        m_throughput = throughput;
+        m_latency = latency;
+
+        m_log << "limit " << previous << " -> " << m_limit.load() << ": " << static_cast<int>(throughput * 10) / 10.0
+            << " validations/s, " << static_cast<int>(latency) << " ms mean latency (" << reason << ")\n" << std::flush;
+        std::ofstream(m_statePath, std::ios::trunc) << m_limit.load();
+    }
+
+    static constexpr size_t MIN_WINDOW_COMPLETIONS = 4;
+    static constexpr size_t PROBE_AFTER_WINDOWS = 3;
+
+    std::filesystem::path m_statePath;
+    std::filesystem::path m_logPath;
+    std::ofstream m_log;
+    size_t m_maximum;
+    std::atomic<size_t> m_limit{ 1 };
+    std::mutex m_mutex;
+    std::chrono::steady_clock::time_point m_windowStart;
+    std::chrono::steady_clock::time_point m_lastCompletion = std::chrono::steady_clock::now();
+    size_t m_windowCount = 0;
+    double m_windowLatency = 0;
+    double m_throughput = 0;
+    double m_latency = 0;
+    size_t m_steadyWindows = 0;
+};
+
+// Verdicts and durations of a tree's files from earlier runs, stored with the tree's cached
+// state. Each file's failure score halves with every run and gains one when it fails, so it
+// reflects how recently and how often the file failed.
+class ValidationHistory {
+public:
+    struct Entry {
+        // Size and timestamp of the file when it was last validated
+        std::string signature;
+        bool failed = false;
+        double failureScore = 0;
+        // Moving average of the validation time
+        double milliseconds = 0;
+    };
+
+    explicit ValidationHistory(std::filesystem::path path) : m_path(std::move(path)) {
+        std::ifstream file(m_path);
+        std::string line;
+        while (std::getline(file, line)) {
+            std::vector<std::string> fields = splitString(line, '\t');
+            if (fields.size() != 5) {
+                continue;
+            }
+            try {
+                Entry entry;
+                entry.signature = fields[1];
+                entry.failed = fields[2] == "1";
+                entry.failureScore = std::stod(fields[3]);
+                entry.milliseconds = std::stod(fields[4]);
+                m_entries[fields[0]] = entry;
+            }
+            catch (...) {
+            }
+        }
+    }
+
+    static std::string signature(const std::filesystem::path& file) {
+        std::error_code ec;
+        auto size = std::filesystem::file_size(file, ec);
+        auto modified = std::filesystem::last_write_time(file, ec).time_since_epoch().count();
+        return std::to_string(size) + "|" + std::to_string(modified);
+    }
+
+    bool lookup(const std::string& key, Entry& entry) {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        auto it = m_entries.find(key);
+        if (it == m_entries.end()) {
+            return false;
+        }
+        entry = it->second;
+        return true;
+    }
+
+    void record(const std::string& key, const std::string& signature, bool failed, double milliseconds) {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        bool known = m_entries.count(key) > 0;
+        Entry& entry = m_entries[key];
+        entry.signature = signature;
+        entry.failed = failed;
+        entry.failureScore = entry.failureScore / 2 + (failed ? 1 : 0);
+        entry.milliseconds = !known ? milliseconds : (entry.milliseconds * 3 + milliseconds) / 4;
+    }
+
+    void save() {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        std::ofstream file(m_path, std::ios::trunc);
+        for (const auto& [key, entry] : m_entries) {
+            file << key << '\t' << entry.signature << '\t' << (entry.failed ? 1 : 0) << '\t'
+                << entry.failureScore << '\t' << entry.milliseconds << '\n';
+        }
+    }
+
+private:
+    std::filesystem::path m_path;
+    std::mutex m_mutex;
+    std::map<std::string, Entry> m_entries;
+};
+
+// Number of cached tree listings kept per source tree
+constexpr size_t GIT_TREE_CACHE_ENTRIES = 8;
+
+// A git checkout, read without running git where possible. Refs and the index are parsed
+// straight from the git directory; only listing a commit's tree runs git, and the listing
+// is cached with the tree's state under the commit id, which never changes meaning.
+class GitWorkingTree {
+public:
+    struct IndexEntry {
+        // Relative to the repository root, with forward slashes
+        std::string path;
+        std::string objectId;
+        // Nonzero for the sides of an unresolved merge conflict
+        unsigned stage = 0;
+        // Not checked out in a sparse checkout
+        bool skipWorktree = false;
+        uint32_t modifiedSeconds = 0;
+        uint32_t modifiedNanoseconds = 0;
+        uint32_t size = 0;
+    };
+
+    // Finds the checkout that contains the directory
+    explicit GitWorkingTree(const std::filesystem::path& directory) {
+        std::error_code ec;
+        for (std::filesystem::path current = std::filesystem::absolute(directory, ec).lexically_normal(); ; current = current.parent_path()) {
+            std::filesystem::path dotGit = current / ".git";
+            if (std::filesystem::is_directory(dotGit, ec)) {
+                m_root = current;
+                m_gitDirectory = dotGit;
+                break;
+            }
+            if (std::filesystem::is_regular_file(dotGit, ec)) {
+                // Linked worktrees and submodules name their git directory in a file
+                std::string line = trimString(readFileContents(dotGit));
+                if (line.rfind("gitdir:", 0) == 0) {
+                    m_root = current;
+                    m_gitDirectory = current / std::filesystem::path(toWide(trimString(line.substr(7))));
+                }
+                break;
+            }
+            if (current == current.parent_path()) {
+                break;
+            }
+        }
+        if (m_gitDirectory.empty()) {
+            return;
+        }
+        m_commonDirectory = m_gitDirectory;
+        std::string common = trimString(readFileContents(m_gitDirectory / "commondir"));
+        if (!common.empty()) {
+            m_commonDirectory = m_gitDirectory / std::filesystem::path(toWide(common));
+        }
+        std::string config = readFileContents(m_commonDirectory / "config");
+        if (std::regex_search(config, std::regex(R"(objectformat\s*=\s*sha256)", std::regex::icase))) {
+            m_objectIdBytes = 32;
+        }
+    }
+
+    bool valid() const {
+        return !m_gitDirectory.empty();
+    }
+
+    const std::filesystem::path& root() const {
+        return m_root;
+    }
+
+    std::filesystem::path absolutePath(const std::string& relative) const {
+        return (m_root / std::filesystem::path(toWide(relative))).lexically_normal();
+    }
+
+    // Commit id of a branch, tag, remote branch or full id, read from the ref files; other
+    // revisions, such as HEAD~2 or abbreviated ids, are left to git rev-parse
+    std::string resolve(const std::string& revision) const {
+        if (isObjectId(revision)) {
+            return revision;
+        }
+        for (const std::string& name : { revision, "refs/" + revision, "refs/tags/" + revision, "refs/heads/" + revision,
+            "refs/remotes/" + revision, "refs/remotes/" + revision + "/HEAD" }) {
+            std::string id = readRef(name, 0);
+            if (!id.empty()) {
+                return id;
+            }
+        }
+        DWORD exitCode = 1;
+        CommandOptions options;
+        options.exitCode = &exitCode;
+        std::string id = trimString(runShellCommand(gitCommand() + " rev-parse --verify --quiet " + quoteArgument(revision + "^{commit}"), options));
+        return exitCode == 0 && isObjectId(id) ? id : "";
+    }
+
+    // Parses the index, versions 2 to 4; sparse directory and submodule entries are skipped
+    bool readIndex(std::vector<IndexEntry>& entries) {
+        std::filesystem::path indexPath = m_gitDirectory / "index";
+        std::string data = readFileContents(indexPath);
+        if (data.size() < 12 || data.compare(0, 4, "DIRC") != 0) {
+            return false;
+        }
+        uint32_t version = bigEndian32(data, 4);
+        uint32_t count = bigEndian32(data, 8);
+        if (version < 2 || version > 4) {
+            return false;
+        }
+        uint32_t indexNanoseconds = 0;
+        uint32_t indexSize = 0;
+        statFile(indexPath, m_indexSeconds, indexNanoseconds, indexSize);
+
+        size_t offset = 12;
+        std::string previous;
+        for (uint32_t i = 0; i < count; i++) {
+            size_t fixed = 40 + m_objectIdBytes + 2;
+            if (offset + fixed > data.size()) {
+                return false;
+            }
+            IndexEntry entry;
+            entry.modifiedSeconds = bigEndian32(data, offset + 8);
+            entry.modifiedNanoseconds = bigEndian32(data, offset + 12);
+            uint32_t mode = bigEndian32(data, offset + 24);
+            entry.size = bigEndian32(data, offset + 36);
+            for (size_t byte = 0; byte < m_objectIdBytes; byte++) {
+                static const char digits[] = "0123456789abcdef";
+                unsigned char value = static_cast<unsigned char>(data[offset + 40 + byte]);
+                entry.objectId += digits[value >> 4];
+                entry.objectId += digits[value & 15];
+            }
+            uint16_t flags = bigEndian16(data, offset + 40 + m_objectIdBytes);
+            entry.stage = (flags >> 12) & 3;
+            size_t cursor = offset + fixed;
+            if (version >= 3 && (flags & 0x4000)) {
+                if (cursor + 2 > data.size()) {
+                    return false;
+                }
+                entry.skipWorktree = (bigEndian16(data, cursor) & 0x4000) != 0;
+                cursor += 2;
+            }
+
+            size_t strip = 0;
+            if (version == 4) {
+                // The path drops bytes from the end of the previous entry's path and adds its own
+                if (cursor >= data.size()) {
+                    return false;
+                }
+                unsigned char c = static_cast<unsigned char>(data[cursor++]);
+                strip = c & 127;
+                while (c & 128) {
+                    if (cursor >= data.size()) {
+                        return false;
+                    }
+                    c = static_cast<unsigned char>(data[cursor++]);
+                    strip = ((strip + 1) << 7) | (c & 127);
+                }
+                if (strip > previous.size()) {
+                    return false;
+                }
+            }
+            size_t end = data.find('\0', cursor);
+            if (end == std::string::npos) {
+                return false;
+            }
+            if (version == 4) {
+                entry.path = previous.substr(0, previous.size() - strip) + data.substr(cursor, end - cursor);
+                offset = end + 1;
+            }
+            else {
+                entry.path = data.substr(cursor, end - cursor);
+                // Entries are padded with NULs to a multiple of eight bytes
+                offset += (end - offset + 8) & ~static_cast<size_t>(7);
+            }
+            previous = entry.path;
+
+            uint32_t type = mode & 0170000;
+            if (type != 0040000 && type != 0160000) {
+                entries.push_back(std::move(entry));
+            }
+        }
+        return true;
+    }
+
+    // Blob ids of every file in a commit's tree, by path
+    bool listTree(const std::string& commitId, std::map<std::string, std::string>& blobs) {
+        std::filesystem::path directory = SourceDependencyIndex::treeCacheDirectory(m_root);
+        std::filesystem::path cachePath = directory / ("tree-" + commitId + ".txt");
+        std::ifstream cached(cachePath, std::ios::binary);
+        if (cached) {
+            std::string line;
+            while (std::getline(cached, line)) {
+                size_t tab = line.find('\t');
+                if (tab != std::string::npos) {
+                    blobs[line.substr(tab + 1)] = line.substr(0, tab);
+                }
+            }
+            return true;
+        }
+
+        DWORD exitCode = 1;
+        CommandOptions options;
+        options.exitCode = &exitCode;
+        std::string listing = runShellCommand(gitCommand() + " ls-tree -r -z --full-tree " + commitId, options);
+        if (exitCode != 0) {
+            return false;
+        }
+        // Entries are "<mode> <type> <id>\t<path>", each ending in a NUL
+        std::ostringstream contents;
+        for (const std::string& entry : splitString(listing, '\0')) {
+            size_t tab = entry.find('\t');
+            std::vector<std::string> fields = splitString(entry.substr(0, tab), ' ');
+            if (tab == std::string::npos || fields.size() != 3 || fields[1] != "blob") {
+                continue;
+            }
+            blobs[entry.substr(tab + 1)] = fields[2];
+            contents << fields[2] << '\t' << entry.substr(tab + 1) << '\n';
+        }
+
+        std::error_code ec;
+        std::filesystem::path temporary = cachePath;
+        temporary += ".tmp";
+        std::ofstream(temporary, std::ios::binary | std::ios::trunc) << contents.str();
+        std::filesystem::rename(temporary, cachePath, ec);
+        trimTreeCache(directory);
+        return true;
+    }
+
+    // Files under a directory of the checkout that differ from a revision: changed, added
+    // or deleted, staged or not, and conflicted ones. Tracked receives every file in the
+    // index under the directory.
+    bool changedSince(const std::string& revision, const std::filesystem::path& directory,
+        std::vector<std::filesystem::path>& changed, std::vector<std::filesystem::path>& tracked, std::string& error) {
+        std::string commitId = resolve(revision);
+        if (commitId.empty()) {
+            error = "Unknown revision " + revision;
+            return false;
+        }
+        std::map<std::string, std::string> base;
+        if (!listTree(commitId, base)) {
+            error = "Cannot list the files of " + revision;
+            return false;
+        }
+        std::vector<IndexEntry> entries;
+        if (!readIndex(entries)) {
+            error = "Cannot read the git index of " + toUtf8(m_root.wstring());
+            return false;
+        }
+
+        std::string prefix = prefixOf(directory);
+        std::set<std::string> seen;
+        for (const auto& entry : entries) {
+            if (entry.path.rfind(prefix, 0) != 0 || !seen.insert(entry.path).second) {
+                continue;
+            }
+            std::filesystem::path file = absolutePath(entry.path);
+            tracked.push_back(file);
+            auto it = base.find(entry.path);
+            if (entry.stage != 0 || it == base.end() || it->second != entry.objectId || differsFromIndex(entry)) {
+                changed.push_back(file);
+            }
+        }
+        for (const auto& [path, id] : base) {
+            if (path.rfind(prefix, 0) == 0 && !seen.count(path)) {
+                changed.push_back(absolutePath(path));
+            }
+        }
+        return true;
+    }
+
+    // Index entries under a directory whose staged blob differs from the commit's, or every
+    // entry under it when there is no commit yet. Conflicted files cannot be committed and
+    // are left out.
+    bool stagedSince(const std::string& commitId, const std::filesystem::path& directory,
+        std::vector<IndexEntry>& staged, std::vector<IndexEntry>& entries, std::string& error) {
+        std::map<std::string, std::string> base;
+        if (!commitId.empty() && !listTree(commitId, base)) {
+            error = "Cannot list the files of " + commitId;
+            return false;
+        }
+        if (!readIndex(entries)) {
+            error = "Cannot read the git index of " + toUtf8(m_root.wstring());
+            return false;
+        }
+        std::string prefix = prefixOf(directory);
+        for (const auto& entry : entries) {
+            auto it = base.find(entry.path);
+            if (entry.stage == 0 && entry.path.rfind(prefix, 0) == 0 && (it == base.end() || it->second != entry.objectId)) {
+                staged.push_back(entry);
+            }
+        }
+        return true;
+    }
+
+    // Whether the working copy may differ from the staged blob. A file whose size and
+    // modification time match the index is taken to match it, as git status does.
+    bool differsFromIndex(const IndexEntry& entry) const {
+        if (entry.skipWorktree) {
+            return false;
+        }
+        uint32_t seconds = 0;
+        uint32_t nanoseconds = 0;
+        uint32_t size = 0;
+        if (!statFile(absolutePath(entry.path), seconds, nanoseconds, size)) {
+            return true;
+        }
+        if (seconds != entry.modifiedSeconds || size != entry.size
+            || (entry.modifiedNanoseconds != 0 && nanoseconds != entry.modifiedNanoseconds)) {
+            return true;
+        }
+        // Modified in the second the index was written, so the index cannot vouch for it
+        return seconds >= m_indexSeconds;
+    }
+
+private:
+    // Path of a directory of the checkout relative to its root, ending in a slash unless empty
+    std::string prefixOf(const std::filesystem::path& directory) const {
+        std::string prefix = toUtf8(std::filesystem::absolute(directory).lexically_normal().lexically_relative(m_root).generic_wstring());
+        return prefix == "." ? "" : prefix + "/";
+    }
+
+    static bool isObjectId(const std::string& text) {
+        return (text.size() == 40 || text.size() == 64)
+            && text.find_first_not_of("0123456789abcdef") == std::string::npos;
+    }
+
+    static uint32_t bigEndian32(const std::string& data, size_t offset) {
+        return (static_cast<uint32_t>(static_cast<unsigned char>(data[offset])) << 24)
+            | (static_cast<uint32_t>(static_cast<unsigned char>(data[offset + 1])) << 16)
+            | (static_cast<uint32_t>(static_cast<unsigned char>(data[offset + 2])) << 8)
+            | static_cast<unsigned char>(data[offset + 3]);
+    }
+
+    static uint16_t bigEndian16(const std::string& data, size_t offset) {
+        return static_cast<uint16_t>((static_cast<unsigned char>(data[offset]) << 8) | static_cast<unsigned char>(data[offset + 1]));
+    }
+
+    // Modification time as git records it, in seconds and nanoseconds since 1970, and the
+    // size truncated to 32 bits
+    static bool statFile(const std::filesystem::path& path, uint32_t& seconds, uint32_t& nanoseconds, uint32_t& size) {
+        WIN32_FILE_ATTRIBUTE_DATA attributes{};
+        if (!GetFileAttributesExW(path.wstring().c_str(), GetFileExInfoStandard, &attributes)) {
+            return false;
+        }
+        constexpr uint64_t UNIX_EPOCH_TICKS = 116444736000000000ull;
+        uint64_t ticks = ((static_cast<uint64_t>(attributes.ftLastWriteTime.dwHighDateTime) << 32)
+            | attributes.ftLastWriteTime.dwLowDateTime) - UNIX_EPOCH_TICKS;
+        seconds = static_cast<uint32_t>(ticks / 10000000);
+        nanoseconds = static_cast<uint32_t>(ticks % 10000000) * 100;
+        size = attributes.nFileSizeLow;
+        return true;
+    }
+
+    // Reads a loose ref, following symbolic refs, or else its packed-refs line, preferring
+    // the commit a tag points to
+    std::string readRef(const std::string& name, int depth) const {
+        if (depth > 5 || name.find("..") != std::string::npos) {
+            return "";
+        }
+        // HEAD and the other refs outside refs/ belong to the worktree
+        const std::filesystem::path& directory = name.rfind("refs/", 0) == 0 ? m_commonDirectory : m_gitDirectory;
+        std::string contents = trimString(readFileContents(directory / std::filesystem::path(toWide(name))));
+        if (contents.rfind("ref:", 0) == 0) {
+            return readRef(trimString(contents.substr(4)), depth + 1);
+        }
+        if (isObjectId(contents)) {
+            return contents;
+        }
+
+        std::istringstream packed(readFileContents(m_commonDirectory / "packed-refs"));
+        std::string line;
+        std::string found;
+        while (std::getline(packed, line)) {
+            line = trimString(line);
+            if (!found.empty()) {
+                return line.size() > 1 && line[0] == '^' && isObjectId(line.substr(1)) ? line.substr(1) : found;
+            }
+            size_t space = line.find(' ');
+            if (space != std::string::npos && line.substr(space + 1) == name && isObjectId(line.substr(0, space))) {
+                found = line.substr(0, space);
+            }
+        }
+        return found;
+    }
+
+    std::string gitCommand() const {
+        return "git -C " + quoteArgument(toUtf8(m_root.wstring()));
+    }
+
+    static void trimTreeCache(const std::filesystem::path& directory) {
+        std::vector<std::pair<std::filesystem::file_time_type, std::filesystem::path>> listings;
+        std::error_code ec;
+        for (const auto& item : std::filesystem::directory_iterator(directory, ec)) {
+            std::string name = item.path().filename().string();
+            if (name.rfind("tree-", 0) == 0 && item.path().extension() == ".txt") {
+                listings.emplace_back(item.last_write_time(ec), item.path());
+            }
+        }
+        if (listings.size() <= GIT_TREE_CACHE_ENTRIES) {
+            return;
+        }
+        std::sort(listings.begin(), listings.end());
+        for (size_t i = 0; i + GIT_TREE_CACHE_ENTRIES < listings.size(); i++) {
+            std::filesystem::remove(listings[i].second, ec);
+        }
+    }
+
+    std::filesystem::path m_root;
+    std::filesystem::path m_gitDirectory;
+    std::filesystem::path m_commonDirectory;
+    size_t m_objectIdBytes = 20;
+    uint32_t m_indexSeconds = 0;
+};
+
+// Reads blobs from the object store through one git cat-file --batch process, which
+// answers each id written to its stdin with "<id> <type> <size>", the contents and a newline.
+// Its stderr is discarded, since a warning in the middle of the answers would break them.
+class GitObjectReader {
+public:
+    explicit GitObjectReader(const std::filesystem::path& root) {
+        m_started = m_process.start("git -C " + quoteArgument(toUtf8(root.wstring())) + " cat-file --batch", true);
+    }
+
+    bool readBlob(const std::string& objectId, std::string& contents) {
+        if (!m_started || !m_process.writeInput(objectId + "\n")) {
+            return false;
+        }
+        size_t newline = std::string::npos;
+        while ((newline = m_buffer.find('\n', m_position)) == std::string::npos) {
+            if (!fill()) {
+                return false;
+            }
+        }
+        std::vector<std::string> header = splitString(m_buffer.substr(m_position, newline - m_position), ' ');
+        m_position = newline + 1;
+        // Missing objects are answered with "<id> missing" and nothing else
+        if (header.size() != 3 || header[1] != "blob") {
+            return false;
+        }
+        size_t size = static_cast<size_t>(std::strtoull(header[2].c_str(), nullptr, 10));
+        while (m_buffer.size() - m_position < size + 1) {
+            if (!fill()) {
+                return false;
+            }
+        }
+        contents.assign(m_buffer, m_position, size);
+        m_position += size + 1;
+        return true;
+    }
+
+private:
+    bool fill() {
+        if (m_position > 0) {
+            m_buffer.erase(0, m_position);
+            m_position = 0;
+        }
+        return m_process.readSome(m_buffer);
+    }
+
+    ChildProcess m_process;
+    bool m_started = false;
+    std::string m_buffer;
+    size_t m_position = 0;
+};
+
+// Results of a batch run written for merging with the results of other shards. Each shard
+// is a line "shard <index> <count> <files assigned> <wall ms>"; each validated file is a
+// line "file <path relative to the root> <1|0> <ms> <result length>" followed by the result
+// text and a newline, with fields separated by tabs. A merged file holds every shard's line
+// and record, so it can be merged again or serve as the timings of a later sharded run.
+class BatchResults {
+public:
+    struct Shard {
+        size_t index = 1;
+        size_t count = 1;
+        size_t files = 0;
+        double milliseconds = 0;
+    };
+
+    struct Record {
+        std::string file;
+        bool passed = false;
+        double milliseconds = 0;
+        std::string result;
+    };
+
+    std::vector<Shard> shards;
+    std::vector<Record> records;
+
+    bool load(const std::filesystem::path& path) {
+        std::ifstream file(path, std::ios::binary);
+        if (!file) {
+            return false;
+        }
+        std::string line;
+        while (std::getline(file, line)) {
+            std::vector<std::string> fields = splitString(line, '\t');
+            try {
+                if (fields.size() == 5 && fields[0] == "shard") {
+                    shards.push_back({ std::stoul(fields[1]), std::stoul(fields[2]), std::stoul(fields[3]), std::stod(fields[4]) });
+                }
+                else if (fields.size() == 5 && fields[0] == "file") {
+                    Record record{ fields[1], fields[2] == "1", std::stod(fields[3]) };
+                    record.result.resize(std::stoul(fields[4]));
+                    file.read(record.result.data(), static_cast<std::streamsize>(record.result.size()));
+                    file.ignore(1);
+                    if (!file) {
+                        return false;
+                    }
+                    records.push_back(std::move(record));
+                }
+                else if (!line.empty()) {
+                    return false;
+                }
+            }
+            catch (...) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    // Records are written in path order, so equal runs produce equal files
+    bool save(const std::filesystem::path& path) {
+        std::sort(records.begin(), records.end(), [](const Record& a, const Record& b) { return a.file < b.file; });
+        std::ofstream file(path, std::ios::binary | std::ios::trunc);
+        for (const auto& shard : shards) {
+            file << "shard\t" << shard.index << '\t' << shard.count << '\t' << shard.files << '\t'
+                << static_cast<uint64_t>(shard.milliseconds) << '\n';
+        }
+        for (const auto& record : records) {
+            file << "file\t" << record.file << '\t' << (record.passed ? 1 : 0) << '\t'
+                << static_cast<uint64_t>(record.milliseconds) << '\t' << record.result.size() << '\n' << record.result << '\n';
+        }
+        return static_cast<bool>(file.flush());
+    }
+};
+
+// Combines the results files of a sharded run: prints every failure, then totals and each
+// shard's wall time, and optionally writes the merged results. Returns 1 if any file failed,
+// any shard is missing or duplicated, or a shard did not validate every file it was given.
+int mergeBatchResults(const std::vector<std::filesystem::path>& inputs, const std::filesystem::path& output) {
+    BatchResults merged;
+    bool complete = true;
+    std::set<std::string> seen;
+    for (const auto& input : inputs) {
+        BatchResults results;
+        if (!results.load(input)) {
+            std::cerr << "Cannot read results from " << toUtf8(input.wstring()) << "\n";
+            return 1;
+        }
+        merged.shards.insert(merged.shards.end(), results.shards.begin(), results.shards.end());
+        for (auto& record : results.records) {
+            if (seen.insert(record.file).second) {
+                merged.records.push_back(std::move(record));
+            }
+            else {
+                std::cout << "Validated in more than one shard: " << record.file << "\n";
+                complete = false;
+            }
+        }
+    }
+
+    std::sort(merged.shards.begin(), merged.shards.end(), [](const BatchResults::Shard& a, const BatchResults::Shard& b) {
+        return a.count != b.count ? a.count < b.count : a.index < b.index;
+    });
+    size_t count = merged.shards.empty() ? 0 : merged.shards.back().count;
+    std::set<size_t> present;
+    size_t assigned = 0;
+    for (const auto& shard : merged.shards) {
+        if (shard.count != count || !present.insert(shard.index).second) {
+            std::cout << "Unexpected shard " << shard.index << "/" << shard.count << "\n";
+            complete = false;
+        }
+        assigned += shard.files;
+    }
+    for (size_t index = 1; index <= count; index++) {
+        if (!present.count(index)) {
+            std::cout << "Missing shard " << index << "/" << count << "\n";
+            complete = false;
+        }
+    }
+
+    int failures = 0;
+    double validationMilliseconds = 0;
+    for (const auto& record : merged.records) {
+        validationMilliseconds += record.milliseconds;
+        if (!record.passed) {
+            failures++;
+            std::cout << "== " << record.file << ": failed (" << static_cast<int>(record.milliseconds) << " ms)\n"
+                << record.result << "\n";
+        }
+    }
+    if (merged.records.size() < assigned) {
+        std::cout << (assigned - merged.records.size()) << " files were not validated\n";
+        complete = false;
+    }
+
+    double slowest = 0;
+    double wallMilliseconds = 0;
+    for (const auto& shard : merged.shards) {
+        slowest = std::max(slowest, shard.milliseconds);
+        wallMilliseconds += shard.milliseconds;
+        std::cout << "Shard " << shard.index << "/" << shard.count << ": " << shard.files << " files, "
+            << static_cast<uint64_t>(shard.milliseconds) << " ms\n";
+    }
+    std::cout << "Files: " << merged.records.size() << ", passed: " << (merged.records.size() - failures)
+        << ", failed: " << failures << "\n";
+    std::cout << "Validation time: " << static_cast<uint64_t>(validationMilliseconds) << " ms";
+    if (!merged.shards.empty()) {
+        double mean = wallMilliseconds / merged.shards.size();
+        std::cout << "; slowest shard " << static_cast<uint64_t>(slowest) << " ms, mean "
+            << static_cast<uint64_t>(mean) << " ms";
+        if (mean > 0) {
+            std::cout << " (" << static_cast<int>((slowest / mean - 1) * 100) << "% above the mean)";
+        }
+    }
+    std::cout << "\n" << std::flush;
+
+    if (!output.empty() && !merged.save(output)) {
+        std::cerr << "Cannot write " << toUtf8(output.wstring()) << "\n";
+        return 1;
+    }
+    return failures == 0 && complete ? 0 : 1;
+}
+
+// Headless validation of a whole tree on the worker pool, printing each result as it
+// finishes. In watch mode, edits re-validate the edited files and, through the dependency
+// indexes, every file that imports them.
+class BatchRunner {
+public:
+    explicit BatchRunner(const std::filesystem::path& root)
+        : m_root(std::filesystem::absolute(root)),
+        m_controller(SourceDependencyIndex::treeCacheDirectory(m_root) / "concurrency.txt", appDataDirectory() / "concurrency.log",
+            std::max(1u, std::thread::hardware_concurrency()), maxParallel()),
+        m_history(SourceDependencyIndex::treeCacheDirectory(m_root) / "history.txt"),
+        m_engine(static_cast<unsigned>(maxParallel())) {
+        m_indexes.push_back(std::make_unique<SourceDependencyIndex>(m_root, ".py", scanPythonImports));
+        m_indexes.push_back(std::make_unique<SourceDependencyIndex>(m_root, ".js", scanJavaScriptImports));
+    }
+
+    // Every file under the root that a validator accepts, outside skipped directories
+    static std::vector<std::filesystem::path> collectFiles(const std::filesystem::path& root) {
+        std::vector<std::filesystem::path> files;
+        std::error_code ec;
+        for (auto it = std::filesystem::recursive_directory_iterator(root, ec); !ec && it != std::filesystem::recursive_directory_iterator(); it.increment(ec)) {
+            if (it->is_directory(ec) && isSkippedDirectory(it->path())) {
+                it.disable_recursion_pending();
+            }
+            else if (it->is_regular_file(ec) && getValidator("Auto-detect", toUtf8(it->path().wstring()))) {
+                files.push_back(it->path());
+            }
+        }
+        return files;
+    }
+
+    // Dot-directories, and directories of installed packages rather than the tree's own code:
+    // node_modules, site-packages and virtual environments, which hold a pyvenv.cfg
+    static bool isSkippedDirectory(const std::filesystem::path& directory) {
+        std::string name = directory.filename().string();
+        std::error_code ec;
+        return name.rfind('.', 0) == 0 || name == "node_modules" || name == "site-packages" || name == "__pycache__"
+            || std::filesystem::exists(directory / "pyvenv.cfg", ec);
+    }
+
+    // Whether a file of the tree lies in a skipped directory
+    bool inSkippedDirectory(const std::filesystem::path& file) const {
+        std::filesystem::path directory = m_root;
+        std::filesystem::path relative = file.lexically_relative(m_root).parent_path();
+        for (const auto& part : relative) {
+            directory /= part;
+            if (isSkippedDirectory(directory)) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    // Validates one file of the tree together with its companion files. `passed` is set when
+    // the file checked and ran cleanly.
+    std::string validateOne(const std::filesystem::path& file, bool* passed = nullptr) {
+        ValidationRequest request;
+        request.filePath = toUtf8(file.wstring());
+        for (const char* option : { "expected", "input", "cases" }) {
+            std::filesystem::path companion = file;
+            companion += std::string(".") + option;
+            std::error_code ec;
+            if (std::filesystem::exists(companion, ec)) {
+                request.options[option] = toUtf8(companion.wstring());
+            }
+        }
+        bool succeeded = false;
+        std::string result = validateRequest(request, &succeeded);
+        if (passed) {
+            *passed = succeeded;
+        }
+        return result;
+    }
+
+    // Orders files by how likely they are to fail and stops everything at the first failure
+    void setFailFast(bool failFast) {
+        m_failFast = failFast;
+    }
+
+    // Validates only the index-th of count shards of the tree, numbered from 1
+    void setShard(size_t index, size_t count) {
+        m_shardIndex = index;
+        m_shardCount = count;
+    }
+
+    // Balances shards by the durations in the results file of an earlier run
+    bool loadTimings(const std::filesystem::path& path) {
+        BatchResults results;
+        if (!results.load(path)) {
+            return false;
+        }
+        for (const auto& record : results.records) {
+            m_timings[record.file] = record.milliseconds;
+        }
+        return true;
+    }
+
+    // Writes the results of validateAll to a file that mergeBatchResults can combine
+    void setResultsPath(const std::filesystem::path& path) {
+        m_resultsPath = path;
+    }
+
+    // Validates the files that differ from a git revision, committed, staged or not, and
+    // every file that depends on them. Returns the number of files that failed, or 1 if the
+    // changes cannot be determined.
+    int validateChangedSince(const std::string& revision) {
+        GitWorkingTree git(m_root);
+        if (!git.valid()) {
+            std::cerr << toUtf8(m_root.wstring()) << " is not in a git checkout\n";
+            return 1;
+        }
+        std::vector<std::filesystem::path> changed;
+        std::vector<std::filesystem::path> tracked;
+        std::string error;
+        if (!git.changedSince(revision, m_root, changed, tracked, error)) {
+            std::cerr << error << "\n";
+            return 1;
+        }
+
+        // The indexes see every tracked file, so dependents are found even on a first run;
+        // only files that changed since the last run are rescanned
+        tracked.insert(tracked.end(), changed.begin(), changed.end());
+        updateIndexes(tracked);
+        std::vector<std::filesystem::path> files = withDependents(changed);
+        std::cout << changed.size() << " files changed since " << revision << ", " << files.size() << " to validate\n" << std::flush;
+        return validateFiles(files);
+    }
+
+    // Validates what the next commit would contain: the staged version of every file that
+    // differs from HEAD. Files whose working copy matches the index, companions and the
+    // files they depend on included, are validated where they are. The others are written from the object store into a
+    // snapshot directory, together with the staged files they depend on (see
+    // snapshotDependencies), as temporary files that rarely leave the file system cache.
+    int validateStaged() {
+        GitWorkingTree git(m_root);
+        if (!git.valid()) {
+            std::cerr << toUtf8(m_root.wstring()) << " is not in a git checkout\n";
+            return 1;
+        }
+        std::vector<GitWorkingTree::IndexEntry> staged;
+        std::vector<GitWorkingTree::IndexEntry> entries;
+        std::string error;
+        if (!git.stagedSince(git.resolve("HEAD"), m_root, staged, entries, error)) {
+            std::cerr << error << "\n";
+            return 1;
+        }
+        std::map<std::string, const GitWorkingTree::IndexEntry*> byPath;
+        for (const auto& entry : entries) {
+            if (entry.stage == 0) {
+                byPath[entry.path] = &entry;
+            }
+        }
+
+        std::filesystem::path snapshot = appDataDirectory() / "precommit" / toHex(fnv1a64(fileKey(m_root)));
+        std::error_code ec;
+        std::filesystem::remove_all(snapshot, ec);
+        std::vector<std::filesystem::path> files;
+        std::set<std::string> snapshotted;
+        std::unique_ptr<GitObjectReader> reader;
+        for (const auto& entry : staged) {
+            if (!getValidator("Auto-detect", toUtf8(git.absolutePath(entry.path).wstring()))) {
+                continue;
+            }
+            std::vector<const GitWorkingTree::IndexEntry*> needed = { &entry };
+            for (const char* option : { "expected", "input", "cases" }) {
+                auto companion = byPath.find(entry.path + "." + option);
+                if (companion != byPath.end()) {
+                    needed.push_back(companion->second);
+                }
+            }
+            if (std::none_of(needed.begin(), needed.end(), [&](const auto* item) { return git.differsFromIndex(*item); })
+                && dependenciesMatchIndex(git, entry, byPath)) {
+                files.push_back(git.absolutePath(entry.path));
+                continue;
+            }
+
+            if (!reader) {
+                reader = std::make_unique<GitObjectReader>(git.root());
+            }
+            for (const auto* item : needed) {
+                if (snapshotted.insert(item->path).second && !writeSnapshotFile(*reader, *item, snapshot)) {
+                    std::cerr << "Cannot read the staged " << item->path << "\n";
+                    return 1;
+                }
+            }
+            if (!snapshotDependencies(*reader, entry, byPath, snapshot, snapshotted)) {
+                std::cerr << "Cannot read the staged dependencies of " << entry.path << "\n";
+                return 1;
+            }
+            files.push_back(snapshot / std::filesystem::path(toWide(entry.path)));
+        }
+
+        std::cout << files.size() << " staged files to validate\n" << std::flush;
+        // The commit is waiting on these
+        int failures = validateFiles(files, Priority::Interactive);
+        reader.reset();
+        std::filesystem::remove_all(snapshot, ec);
+        return failures;
+    }
+
+    // Returns the number of files that failed
+    int validateAll() {
+        auto start = std::chrono::steady_clock::now();
+        std::vector<std::filesystem::path> files = collectFiles(m_root);
+        updateIndexes(files);
+        if (m_shardCount > 1) {
+            size_t total = files.size();
+            files = shardFiles(files);
+            std::cout << "Shard " << m_shardIndex << "/" << m_shardCount << ": " << files.size() << " of " << total << " files\n" << std::flush;
+        }
+        m_results = BatchResults();
+        int failures = validateFiles(files);
+        if (!m_resultsPath.empty()) {
+            m_results.shards.push_back({ m_shardIndex, m_shardCount, files.size(), ValidationTimings::millisecondsSince(start) });
+            if (!m_results.save(m_resultsPath)) {
+                std::cerr << "Cannot write " << toUtf8(m_resultsPath.wstring()) << "\n";
+                return failures + 1;
+            }
+        }
+        return failures;
+    }
+
+    int watch() {
+        validateAll();
+
+        HandleGuard directory(CreateFileW(m_root.wstring().c_str(), FILE_LIST_DIRECTORY,
+            FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, nullptr, OPEN_EXISTING,
+            FILE_FLAG_BACKUP_SEMANTICS, nullptr), CloseHandle);
+        if (directory.get() == INVALID_HANDLE_VALUE) {
+            directory.release();
+            std::cerr << "Cannot watch " << toUtf8(m_root.wstring()) << "\n";
+            return 1;
+        }
+
+        std::vector<DWORD> buffer(16 * 1024);
+        for (;;) {
+            DWORD bytes = 0;
+            if (!ReadDirectoryChangesW(directory.get(), buffer.data(), static_cast<DWORD>(buffer.size() * sizeof(DWORD)), TRUE,
+                FILE_NOTIFY_CHANGE_FILE_NAME | FILE_NOTIFY_CHANGE_LAST_WRITE | FILE_NOTIFY_CHANGE_SIZE, &bytes, nullptr, nullptr)) {
+                return 1;
+            }
+
+            // Let editors finish writing before validating
+            std::this_thread::sleep_for(std::chrono::milliseconds(200));
+
+            if (bytes == 0) {
+                // The change buffer overflowed, so any file may have changed
+                validateAll();
+                continue;
+            }
+
+            std::set<std::filesystem::path> changed;
+            auto* notification = reinterpret_cast<const FILE_NOTIFY_INFORMATION*>(buffer.data());
+            for (;;) {
+                std::wstring name(notification->FileName, notification->FileNameLength / sizeof(wchar_t));
+                if (!inSkippedDirectory(m_root / name)) {
+                    changed.insert(m_root / name);
+                }
+                if (notification->NextEntryOffset == 0) {
+                    break;
+                }
+                notification = reinterpret_cast<const FILE_NOTIFY_INFORMATION*>(
+                    reinterpret_cast<const char*>(notification) + notification->NextEntryOffset);
+            }
+            revalidate(std::vector<std::filesystem::path>(changed.begin(), changed.end()));
+        }
+    }
+
+private:
+    static bool writeSnapshotFile(GitObjectReader& reader, const GitWorkingTree::IndexEntry& entry, const std::filesystem::path& snapshot) {
+        std::string contents;
+        if (!reader.readBlob(entry.objectId, contents)) {
+            return false;
+        }
+        std::filesystem::path path = snapshot / std::filesystem::path(toWide(entry.path));
+        std::error_code ec;
+        std::filesystem::create_directories(path.parent_path(), ec);
+        HandleGuard file(CreateFileW(path.wstring().c_str(), GENERIC_WRITE, FILE_SHARE_READ | FILE_SHARE_DELETE, nullptr,
+            CREATE_ALWAYS, FILE_ATTRIBUTE_TEMPORARY, nullptr), CloseHandle);
+        if (file.get() == INVALID_HANDLE_VALUE) {
+            file.release();
+            return false;
+        }
+        DWORD written = 0;
+        return WriteFile(file.get(), contents.data(), static_cast<DWORD>(contents.size()), &written, nullptr) && written == contents.size();
+    }
+
+    // Whether the files a staged file needs, found the way snapshotDependencies finds them but
+    // in the working tree, are all tracked and match the index, so that validating in place
+    // sees what the commit will contain. For packaged Java and the languages without an
+    // import scanner, staged files missing from the working tree count as differences too.
+    static bool dependenciesMatchIndex(const GitWorkingTree& git, const GitWorkingTree::IndexEntry& entry,
+        const std::map<std::string, const GitWorkingTree::IndexEntry*>& byPath) {
+        std::filesystem::path file = git.absolutePath(entry.path);
+        std::string extension = file.extension().string();
+        std::filesystem::path base(toWide(fileKey(git.root())));
+        auto relative = [&](const std::filesystem::path& path) {
+            return toUtf8(std::filesystem::path(toWide(fileKey(path))).lexically_relative(base).generic_wstring());
+        };
+        auto matches = [&](const std::string& path) {
+            auto it = byPath.find(path);
+            return it != byPath.end() && !git.differsFromIndex(*it->second);
+        };
+
+        if (extension == ".py" || extension == ".js") {
+            for (const auto& dependency : importClosure(file, extension == ".py" ? scanPythonImports : scanJavaScriptImports)) {
+                if (!matches(relative(std::filesystem::path(toWide(dependency))))) {
+                    return false;
+                }
+            }
+            return true;
+        }
+
+        // The directory whose files of this kind the validator uses: the source root of a
+        // packaged Java file, or the file's own directory
+        std::filesystem::path directory = file.parent_path();
+        bool recursive = false;
+        if (extension == ".java") {
+            std::filesystem::path root;
+            if (!javaSourceRoot(directory, scanJavaSource(readFileContents(file)).packageName, root)) {
+                return true;
+            }
+            directory = root;
+            recursive = true;
+        }
+        std::string prefix = relative(directory);
+        prefix = prefix == "." ? "" : prefix + "/";
+        for (const auto& [path, item] : byPath) {
+            std::filesystem::path candidate(toWide(path));
+            bool inScope = recursive ? path.rfind(prefix, 0) == 0 : candidate.parent_path() == std::filesystem::path(toWide(entry.path)).parent_path();
+            if (inScope && candidate.extension().string() == extension && git.differsFromIndex(*item)) {
+                return false;
+            }
+        }
+        std::error_code ec;
+        auto untracked = [&](const std::filesystem::directory_entry& candidate) {
+            return candidate.is_regular_file(ec) && candidate.path().extension().string() == extension && !byPath.count(relative(candidate.path()));
+        };
+        if (!recursive) {
+            for (const auto& candidate : std::filesystem::directory_iterator(directory, ec)) {
+                if (untracked(candidate)) {
+                    return false;
+                }
+            }
+            return true;
+        }
+        for (auto it = std::filesystem::recursive_directory_iterator(directory, ec); !ec && it != std::filesystem::recursive_directory_iterator(); it.increment(ec)) {
+            if (it->is_directory(ec) && it->path().filename().string().rfind('.', 0) == 0) {
+                it.disable_recursion_pending();
+                continue;
+            }
+            if (untracked(*it)) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    // Adds the staged files a snapshotted file needs to run. A packaged Java file is built
+    // with every source under its source root, so every staged one there is added. Python
+    // and JavaScript files get the closure of their imports, followed through the staged
+    // contents the way importClosure follows them on disk; since the scanners resolve
+    // imports against the files present, the staged files they could reach are put in place
+    // empty first, filled in as the closure reaches them, and the rest removed afterwards.
+    // Languages without an import scanner get the staged files of the same kind next to them.
+    static bool snapshotDependencies(GitObjectReader& reader, const GitWorkingTree::IndexEntry& entry,
+        const std::map<std::string, const GitWorkingTree::IndexEntry*>& byPath, const std::filesystem::path& snapshot,
+        std::set<std::string>& snapshotted) {
+        std::filesystem::path entryPath(toWide(entry.path));
+        std::string extension = entryPath.extension().string();
+        std::string directory = toUtf8(entryPath.parent_path().generic_wstring());
+        std::string prefix = directory.empty() ? "" : directory + "/";
+        auto add = [&](const GitWorkingTree::IndexEntry& item) {
+            return !snapshotted.insert(item.path).second || writeSnapshotFile(reader, item, snapshot);
+        };
+        auto under = [](const std::string& path, const std::string& directoryPrefix) {
+            return path.rfind(directoryPrefix, 0) == 0;
+        };
+
+        if (extension == ".java") {
+            JavaSourceInfo info = scanJavaSource(readFileContents(snapshot / entryPath));
+            std::filesystem::path root;
+            if (!javaSourceRoot(entryPath.parent_path(), info.packageName, root)) {
+                return true;
+            }
+            std::string rootPrefix = root.empty() ? "" : toUtf8(root.generic_wstring()) + "/";
+            for (const auto& [path, item] : byPath) {
+                if (under(path, rootPrefix) && std::filesystem::path(toWide(path)).extension() == ".java" && !add(*item)) {
+                    return false;
+                }
+            }
+            return true;
+        }
+
+        std::function<std::set<std::string>(const std::filesystem::path&, const std::filesystem::path&)> scanner;
+        std::set<std::string> importable;
+        if (extension == ".py") {
+            scanner = scanPythonImports;
+            importable = { ".py" };
+        }
+        else if (extension == ".js") {
+            scanner = scanJavaScriptImports;
+            importable = { ".js", ".mjs", ".cjs", ".json" };
+            // Node reads the package.json files on the way for "main" and the module type
+            for (const auto& [path, item] : byPath) {
+                std::filesystem::path candidate(toWide(path));
+                std::string manifestDirectory = toUtf8(candidate.parent_path().generic_wstring());
+                manifestDirectory = manifestDirectory.empty() ? "" : manifestDirectory + "/";
+                if (candidate.filename() == "package.json" && (under(path, prefix) || under(prefix, manifestDirectory)) && !add(*item)) {
+                    return false;
+                }
+            }
+        }
+        else {
+            for (const auto& [path, item] : byPath) {
+                std::filesystem::path candidate(toWide(path));
+                if (candidate.parent_path() == entryPath.parent_path() && candidate.extension().string() == extension && !add(*item)) {
+                    return false;
+                }
+            }
+            return true;
+        }
+
+        std::set<std::string> placeholders;
+        for (const auto& [path, item] : byPath) {
+            std::filesystem::path candidate(toWide(path));
+            if (!under(path, prefix) || snapshotted.count(path) || !importable.count(candidate.extension().string())) {
+                continue;
+            }
+            std::filesystem::path file = snapshot / candidate;
+            std::error_code ec;
+            std::filesystem::create_directories(file.parent_path(), ec);
+            if (!std::ofstream(file, std::ios::binary)) {
+                return false;
+            }
+            placeholders.insert(path);
+        }
+
+        std::filesystem::path base(toWide(fileKey(snapshot)));
+        std::filesystem::path root = snapshot / entryPath.parent_path();
+        std::set<std::string> visited = { entry.path };
+        std::vector<std::string> pending = { entry.path };
+        bool complete = true;
+        while (!pending.empty() && complete) {
+            std::filesystem::path next = snapshot / std::filesystem::path(toWide(pending.back()));
+            pending.pop_back();
+            for (const auto& dependency : scanner(next, root)) {
+                std::string path = toUtf8(std::filesystem::path(toWide(dependency)).lexically_relative(base).generic_wstring());
+                if (!byPath.count(path) || !visited.insert(path).second) {
+                    continue;
+                }
+                if (placeholders.erase(path) && !add(*byPath.at(path))) {
+                    complete = false;
+                    break;
+                }
+                pending.push_back(path);
+            }
+        }
+        for (const auto& path : placeholders) {
+            std::error_code ec;
+            std::filesystem::remove(snapshot / std::filesystem::path(toWide(path)), ec);
+        }
+        return complete;
+    }
+
+    void updateIndexes(const std::vector<std::filesystem::path>& files) {
+        for (auto& index : m_indexes) {
+            index->update(files);
+            index->save();
+        }
+    }
 
-protected:
-    // Helper to run a command and capture output
-    std::string executeCommand(const std::string& command) {
-        std::array<char, 4096> buffer{};
-        std::string result;
-        std::unique_ptr<FILE, decltype(&_pclose)> pipe(_popen(command.c_str(), "r"), _pclose);
+    // Re-validates changed files and everything that depends on them
+    void revalidate(const std::vector<std::filesystem::path>& changed) {
+        updateIndexes(changed);
+        // The user is waiting on these: they follow a save
+        validateFiles(withDependents(changed), Priority::Interactive);
+    }
 
-        if (!pipe) {
-            return "Error executing command: " + command;
+    // The changed files that still exist and everything that imports them, directly or
+    // transitively, limited to files a validator accepts
+    std::vector<std::filesystem::path> withDependents(const std::vector<std::filesystem::path>& changed) {
+        std::set<std::string> changedKeys;
+        for (const auto& file : changed) {
+            changedKeys.insert(fileKey(file));
         }
 
-        while (fgets(buffer.data(), buffer.size(), pipe.get()) != nullptr) {
-            result += buffer.data();
+        std::set<std::string> affected = changedKeys;
+        for (const auto& index : m_indexes) {
+            std::set<std::string> dependents = index->affectedBy(changedKeys);
+            affected.insert(dependents.begin(), dependents.end());
         }
 
-        return result;
+        std::vector<std::filesystem::path> files;
+        std::error_code ec;
+        for (const auto& key : affected) {
+            std::filesystem::path file(toWide(key));
+            if (std::filesystem::is_regular_file(file, ec) && getValidator("Auto-detect", key)) {
+                files.push_back(file);
+            }
+        }
+        return files;
     }
 
-    std::string escapeFilePath(const std::string& filePath) {
-        std::string escaped = filePath;
-        // Replace all backslashes with double backslashes for command line
-        size_t pos = 0;
-        while ((pos = escaped.find("\\", pos)) != std::string::npos) {
-            escaped.replace(pos, 1, "\\\\");
-            pos += 2;
+    int validateFiles(const std::vector<std::filesystem::path>& files, Priority priority = Priority::Background) {
+        std::mutex doneMutex;
+        std::condition_variable done;
+        size_t running = 0;
+        size_t started = 0;
+        int failures = 0;
+        std::atomic<bool> stopped{ false };
+        CancellationGroup group;
+
+        // Background batches keep only as many validations in flight as the controller allows
+        bool controlled = priority == Priority::Background;
+        std::vector<std::filesystem::path> ordered = m_failFast && controlled ? failFastOrder(files) : files;
+        if (controlled) {
+            m_controller.begin(ordered.size());
         }
-        return "\"" + escaped + "\"";
+        for (const auto& file : ordered) {
+            {
+                std::unique_lock<std::mutex> lock(doneMutex);
+                done.wait(lock, [&] { return stopped || !controlled || running < m_controller.limit(); });
+                if (stopped) {
+                    break;
+                }
+                running++;
+                started++;
+            }
+            m_engine.submit([&, file]() {
+                CancellationGroup::Scope scope(&group);
+                std::string signature = ValidationHistory::signature(file);
+                auto start = std::chrono::steady_clock::now();
+                bool succeeded = false;
+                std::string result = validateOne(file, &succeeded);
+                double milliseconds = ValidationTimings::millisecondsSince(start);
+                if (controlled) {
+                    m_controller.completed(milliseconds);
+                }
+
+                // Results that finish after a fail-fast stop were cut short and say nothing
+                if (!stopped) {
+                    m_history.record(fileKey(file), signature, !succeeded, milliseconds);
+                    if (!succeeded && m_failFast && !stopped.exchange(true)) {
+                        group.cancel();
+                    }
+                    std::lock_guard<std::mutex> lock(m_outputMutex);
+                    std::cout << "== " << toUtf8(file.wstring()) << ": " << (succeeded ? "ok" : "failed")
+                        << " (" << static_cast<int>(milliseconds) << " ms)\n" << result << "\n" << std::flush;
+                    if (!m_resultsPath.empty()) {
+                        m_results.records.push_back({ relativeKey(file), succeeded, milliseconds, result });
+                    }
+                }
+
+                std::lock_guard<std::mutex> lock(doneMutex);
+                if (!succeeded) {
+                    failures++;
+                }
+                running--;
+                done.notify_all();
+            }, priority);
+        }
+
+        std::unique_lock<std::mutex> lock(doneMutex);
+        done.wait(lock, [&] { return running == 0; });
+        m_history.save();
+        if (stopped) {
+            std::cout << "Stopped at the first failure; " << (ordered.size() - started) << " files not started\n" << std::flush;
+            return 1;
+        }
+        return failures;
     }
-};
 
-// Java validator
-class JavaValidator : public LanguageValidator {
-public:
-    bool isCompatible(const std::string& filePath) override {
-        std::filesystem::path path(filePath);
-        return path.extension() == ".java";
+    // Fail-fast order: files that failed last time, then files that changed since they were
+    // last validated or were never validated, then the rest. Within each group, files with
+    // more recent failures go first, then quicker ones.
+    std::vector<std::filesystem::path> failFastOrder(const std::vector<std::filesystem::path>& files) {
+        struct Ranked {
+            std::filesystem::path file;
+            int group = 1;
+            double failureScore = 0;
+            double milliseconds = 0;
+        };
+        std::vector<Ranked> ranked;
+        ranked.reserve(files.size());
+        for (const auto& file : files) {
+            Ranked rank{ file };
+            ValidationHistory::Entry entry;
+            if (m_history.lookup(fileKey(file), entry)) {
+                rank.group = entry.failed ? 0 : entry.signature != ValidationHistory::signature(file) ? 1 : 2;
+                rank.failureScore = entry.failureScore;
+                rank.milliseconds = entry.milliseconds;
+            }
+            ranked.push_back(std::move(rank));
+        }
+        std::stable_sort(ranked.begin(), ranked.end(), [](const Ranked& a, const Ranked& b) {
+            if (a.group != b.group) {
+                return a.group < b.group;
+            }
+            if (a.failureScore != b.failureScore) {
+                return a.failureScore > b.failureScore;
+            }
+            return a.milliseconds < b.milliseconds;
+        });
+
+        std::vector<std::filesystem::path> ordered;
+        ordered.reserve(ranked.size());
+        for (auto& rank : ranked) {
+            ordered.push_back(std::move(rank.file));
+        }
+        return ordered;
     }
 
-    std::string validate(const std::string& filePath) override {
-        std::filesystem::path path(filePath);
-        std::string className = path.stem().string();
-        std::string directory = path.parent_path().string();
+    // Path relative to the root with forward slashes, the same on every machine
+    std::string relativeKey(const std::filesystem::path& file) const {
+        return toUtf8(file.lexically_relative(m_root).generic_wstring());
+    }
 
-        // Compile Java file
-        std::string compileCommand = "javac " + escapeFilePath(filePath) + " 2>&1";
-        std::string compileResult = executeCommand(compileCommand);
+    // This job's shard of the tree. Every job computes the same split from the same files
+    // and timings: files are dealt, most expensive first, to the shard with the least
+    // estimated time so far, with ties broken by a hash of the relative path. Files without
+    // a timing cost the mean of those with one, so without timings every file costs the
+    // same and the files are dealt round-robin in hash order.
+    std::vector<std::filesystem::path> shardFiles(const std::vector<std::filesystem::path>& files) const {
+        struct Costed {
+            std::filesystem::path file;
+            std::string key;
+            uint64_t hash = 0;
+            double cost = 0;
+        };
+        std::vector<Costed> costed;
+        costed.reserve(files.size());
+        double knownTotal = 0;
+        size_t known = 0;
+        for (const auto& file : files) {
+            std::string key = relativeKey(file);
+            auto timing = m_timings.find(key);
+            double cost = -1;
+            if (timing != m_timings.end()) {
+                cost = timing->second;
+                knownTotal += cost;
+                known++;
+            }
+            costed.push_back({ file, key, fnv1a64(key), cost });
+        }
+        double unknownCost = known > 0 ? knownTotal / known : 1;
+        for (auto& entry : costed) {
+            if (entry.cost < 0) {
+                entry.cost = unknownCost;
+            }
+        }
+        std::sort(costed.begin(), costed.end(), [](const Costed& a, const Costed& b) {
+            if (a.cost != b.cost) {
+                return a.cost > b.cost;
+            }
+            return a.hash != b.hash ? a.hash < b.hash : a.key < b.key;
+        });
 
-        if (!compileResult.empty()) {
-            return "Compilation errors:\n" + compileResult;
+        std::vector<double> load(m_shardCount, 0);
+        std::vector<std::filesystem::path> mine;
+        for (const auto& entry : costed) {
+            size_t shard = std::min_element(load.begin(), load.end()) - load.begin();
+            load[shard] += entry.cost;
+            if (shard + 1 == m_shardIndex) {
+                mine.push_back(entry.file);
+            }
         }
+        return mine;
+    }
 
-        // Try to run the class file
-        std::string runCommand = "cd " + escapeFilePath(directory) + " && java " + className + " 2>&1";
-        std::string runResult = executeCommand(runCommand);
+    // Only failed checks are cached, so a cached result never passed
+    std::string validateRequest(const ValidationRequest& request, bool* passed) {
+        *passed = false;
+        std::string key = ResultCache::makeKey(request);
+        std::string result;
+        if (m_cache.lookup(key, result)) {
+            return result;
+        }
+        result = runValidationRequest(m_registry.get(request.language, request.filePath), request, m_engine, passed);
+        if (!CancellationGroup::currentCancelled()) {
+            m_cache.store(key, result);
+        }
+        return result;
+    }
 
-        return "Compilation successful.\nExecution output:\n" + runResult;
+    // Most validations a batch may run at once: CODEVALIDATOR_BATCH_MAX_PARALLEL, by default
+    // two per processor since much of a validation is spent waiting on child processes
+    static size_t maxParallel() {
+        size_t processors = std::max(1u, std::thread::hardware_concurrency());
+        return std::max<size_t>(1, readEnvironmentNumber(L"CODEVALIDATOR_BATCH_MAX_PARALLEL", processors * BATCH_MAX_PARALLEL_PER_CPU));
     }
+
+    std::filesystem::path m_root;
+    std::vector<std::unique_ptr<SourceDependencyIndex>> m_indexes;
+    ValidatorRegistry m_registry;
+    ResultCache m_cache;
+    std::mutex m_outputMutex;
+    ConcurrencyController m_controller;
+    ValidationHistory m_history;
+    bool m_failFast = false;
+    size_t m_shardIndex = 1;
+    size_t m_shardCount = 1;
+    std::map<std::string, double> m_timings;
+    std::filesystem::path m_resultsPath;
+    BatchResults m_results;
+    ValidationEngine m_engine;
 };
 
-// Python validator
-class PythonValidator : public LanguageValidator {
+constexpr char DEFAULT_COORDINATOR_ADDRESS[] = "127.0.0.1:47600";
+
+// Socket wrapper for coordinator and worker connections. Winsock sockets are overlapped file
+// handles, so frames use the same readFrame and writeFrame as the daemon's pipe.
+class SocketConnection {
 public:
-    bool isCompatible(const std::string& filePath) override {
-        std::filesystem::path path(filePath);
-        return path.extension() == ".py";
+    explicit SocketConnection(SOCKET socket) : m_socket(socket) {
+        BOOL noDelay = TRUE;
+        setsockopt(m_socket, IPPROTO_TCP, TCP_NODELAY, reinterpret_cast<const char*>(&noDelay), sizeof(noDelay));
+    }
+    SocketConnection(const SocketConnection&) = delete;
+    SocketConnection& operator=(const SocketConnection&) = delete;
+    ~SocketConnection() {
+        closesocket(m_socket);
     }
 
-    std::string validate(const std::string& filePath) override {
-        // Check syntax without running
-        std::string syntaxCommand = "python -m py_compile " + escapeFilePath(filePath) + " 2>&1";
-        std::string syntaxResult = executeCommand(syntaxCommand);
+    // Null when the address cannot be resolved or nothing listens there
+    static std::unique_ptr<SocketConnection> connectTo(const std::string& address) {
+        std::unique_ptr<SocketConnection> connection;
+        forEachAddress(address, 0, [&](const addrinfo* info) {
+            SOCKET candidate = socket(info->ai_family, info->ai_socktype, info->ai_protocol);
+            if (candidate == INVALID_SOCKET) {
+                return false;
+            }
+            if (connect(candidate, info->ai_addr, static_cast<int>(info->ai_addrlen)) == SOCKET_ERROR) {
+                closesocket(candidate);
+                return false;
+            }
+            connection = std::make_unique<SocketConnection>(candidate);
+            return true;
+        });
+        return connection;
+    }
 
-        if (!syntaxResult.empty() && syntaxResult.find("SyntaxError") != std::string::npos) {
-            return "Syntax errors:\n" + syntaxResult;
+    // Listening socket bound to host:port, or INVALID_SOCKET
+    static SOCKET listenOn(const std::string& address) {
+        SOCKET listener = INVALID_SOCKET;
+        forEachAddress(address, AI_PASSIVE, [&](const addrinfo* info) {
+            SOCKET candidate = socket(info->ai_family, info->ai_socktype, info->ai_protocol);
+            if (candidate == INVALID_SOCKET) {
+                return false;
+            }
+            BOOL exclusive = TRUE;
+            setsockopt(candidate, SOL_SOCKET, SO_EXCLUSIVEADDRUSE, reinterpret_cast<const char*>(&exclusive), sizeof(exclusive));
+            if (bind(candidate, info->ai_addr, static_cast<int>(info->ai_addrlen)) == SOCKET_ERROR || listen(candidate, SOMAXCONN) == SOCKET_ERROR) {
+                closesocket(candidate);
+                return false;
+            }
+            listener = candidate;
+            return true;
+        });
+        return listener;
+    }
+
+    static bool startWinsock() {
+        static const bool started = [] {
+            WSADATA data{};
+            return WSAStartup(MAKEWORD(2, 2), &data) == 0;
+        }();
+        return started;
+    }
+
+    bool read(Frame& frame) {
+        return readFrame(handle(), frame);
+    }
+
+    bool send(const Frame& frame) {
+        std::lock_guard<std::mutex> lock(m_writeMutex);
+        return writeFrame(handle(), frame);
+    }
+
+    // Unblocks a read in progress on another thread
+    void shutdownBoth() {
+        shutdown(m_socket, SD_BOTH);
+    }
+
+    // "host:port" of the other end
+    std::string peerName() const {
+        sockaddr_storage address{};
+        int length = sizeof(address);
+        char host[NI_MAXHOST] = {};
+        char port[NI_MAXSERV] = {};
+        if (getpeername(m_socket, reinterpret_cast<sockaddr*>(&address), &length) == SOCKET_ERROR
+            || getnameinfo(reinterpret_cast<sockaddr*>(&address), length, host, sizeof(host), port, sizeof(port), NI_NUMERICHOST | NI_NUMERICSERV) != 0) {
+            return "?";
         }
+        return std::string(host) + ":" + port;
+    }
 
-        std::string runCommand = "python " + escapeFilePath(filePath) + " 2>&1";
-        std::string runResult = executeCommand(runCommand);
+private:
+    HANDLE handle() const {
+        return reinterpret_cast<HANDLE>(m_socket);
+    }
 
-        return "Compilation successful.\nExecution output:\n" + runResult;
+    // Calls attempt for each address "host:port" resolves to until it returns true
+    static void forEachAddress(const std::string& address, int flags, const std::function<bool(const addrinfo*)>& attempt) {
+        size_t colon = address.rfind(':');
+        if (colon == std::string::npos) {
+            return;
+        }
+        std::string host = address.substr(0, colon);
+        std::string port = address.substr(colon + 1);
+        addrinfo hints{};
+        hints.ai_flags = flags;
+        hints.ai_family = AF_UNSPEC;
+        hints.ai_socktype = SOCK_STREAM;
+        hints.ai_protocol = IPPROTO_TCP;
+        addrinfo* results = nullptr;
+        if (getaddrinfo(host.empty() ? nullptr : host.c_str(), port.c_str(), &hints, &results) != 0) {
+            return;
+        }
+        for (const addrinfo* info = results; info; info = info->ai_next) {
+            if (attempt(info)) {
+                break;
+            }
+        }
+        freeaddrinfo(results);
     }
+
+    SOCKET m_socket;
+    std::mutex m_writeMutex;
 };
 
-// PHP validator
-class PHPValidator : public LanguageValidator {
+// Hands the files of a tree to worker processes over TCP and collects their results.
+// Workers pull work: each asks for as many files as it has free slots and receives up to
+// twice that, so it always has the next file at hand. Once nothing is left to hand out, a
+// worker asking for more takes the newer half of the files another worker has not finished,
+// and that worker is told to drop the ones it has not started. Whichever result arrives
+// first counts. Files of a worker that disconnects go back to the queue.
+class ShardCoordinator {
 public:
-    bool isCompatible(const std::string& filePath) override {
-        std::filesystem::path path(filePath);
-        return path.extension() == ".php";
+    ShardCoordinator(const std::filesystem::path& root, std::string address)
+        : m_root(std::filesystem::absolute(root)), m_address(std::move(address)) {}
+
+    // Returns the process exit code: 1 when a file failed
+    int run() {
+        if (!SocketConnection::startWinsock()) {
+            std::cerr << "Cannot start Winsock\n";
+            return 1;
+        }
+        for (const auto& file : BatchRunner::collectFiles(m_root)) {
+            FileTask task;
+            task.relativePath = toUtf8(file.lexically_relative(m_root).generic_wstring());
+            task.hash = toHex(fnv1a64(readFileContents(file)));
+            m_pending.push_back(static_cast<uint32_t>(m_tasks.size()));
+            m_tasks.push_back(std::move(task));
+        }
+        if (m_tasks.empty()) {
+            return 0;
+        }
+
+        SOCKET listener = SocketConnection::listenOn(m_address);
+        if (listener == INVALID_SOCKET) {
+            std::cerr << "Cannot listen on " << m_address << "\n";
+            return 1;
+        }
+        std::cout << "Coordinating " << m_tasks.size() << " files on " << m_address << "\n" << std::flush;
+        m_threads = 1;
+        std::thread([this, listener]() {
+            for (;;) {
+                SOCKET accepted = accept(listener, nullptr, nullptr);
+                std::lock_guard<std::mutex> lock(m_mutex);
+                if (accepted == INVALID_SOCKET) {
+                    m_threads--;
+                    m_allDone.notify_all();
+                    return;
+                }
+                m_threads++;
+                std::thread(&ShardCoordinator::serveWorker, this, std::make_shared<SocketConnection>(accepted)).detach();
+            }
+        }).detach();
+
+        std::unique_lock<std::mutex> lock(m_mutex);
+        m_allDone.wait(lock, [this] { return m_completed == m_tasks.size(); });
+        for (auto& [id, worker] : m_workers) {
+            worker.connection->send({ 0, FrameType::WorkDone, "" });
+            worker.connection->shutdownBoth();
+        }
+        closesocket(listener);
+        // Connection threads use this object until they end
+        m_allDone.wait(lock, [this] { return m_threads == 0; });
+        std::cout << "Files: " << m_completed - m_failures << " passed, " << m_failures << " failed\n" << std::flush;
+        return m_failures == 0 ? 0 : 1;
     }
 
-    std::string validate(const std::string& filePath) override {
-        // Check syntax without running
-        std::string syntaxCommand = "php -l " + escapeFilePath(filePath) + " 2>&1";
-        std::string syntaxResult = executeCommand(syntaxCommand);
+private:
+    struct FileTask {
+        std::string relativePath;
+        std::string hash;
+        bool done = false;
+    };
 
-        if (syntaxResult.find("No syntax errors") == std::string::npos) {
-            return "Syntax errors:\n" + syntaxResult;
+    struct WorkerState {
+        std::shared_ptr<SocketConnection> connection;
+        std::string name;
+        // Files handed to this worker and not finished yet, oldest first
+        std::vector<uint32_t> assigned;
+        // Free slots of an unanswered request
+        size_t wanted = 0;
+    };
+
+    void serveWorker(std::shared_ptr<SocketConnection> connection) {
+        uint32_t workerId = 0;
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            workerId = m_nextWorkerId++;
+            WorkerState& worker = m_workers[workerId];
+            worker.connection = connection;
+            worker.name = connection->peerName();
         }
 
-        std::string runCommand = "php " + escapeFilePath(filePath) + " 2>&1";
-        std::string runResult = executeCommand(runCommand);
+        Frame frame;
+        while (connection->read(frame)) {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            WorkerState& worker = m_workers[workerId];
+            if (frame.type == FrameType::WorkRequest) {
+                try {
+                    worker.wanted = std::max<size_t>(1, std::stoul(frame.payload));
+                }
+                catch (...) {
+                    worker.wanted = 1;
+                }
+                serve(worker);
+            }
+            else if (frame.type == FrameType::WorkResult) {
+                finish(worker, frame.requestId, frame.payload);
+                serveWaiting();
+            }
+        }
 
-        return "Compilation successful.\nExecution output:\n" + runResult;
+        // Whatever the worker had not finished goes back to the front of the queue
+        std::lock_guard<std::mutex> lock(m_mutex);
+        for (auto it = m_workers[workerId].assigned.rbegin(); it != m_workers[workerId].assigned.rend(); ++it) {
+            if (!m_tasks[*it].done) {
+                m_pending.push_front(*it);
+            }
+        }
+        m_workers.erase(workerId);
+        serveWaiting();
+        m_threads--;
+        m_allDone.notify_all();
     }
-};
 
-// JavaScript validator
-class JavaScriptValidator : public LanguageValidator {
-public:
-    bool isCompatible(const std::string& filePath) override {
-        std::filesystem::path path(filePath);
-        return path.extension() == ".js";
+    // Answers the worker's request if there is anything to give it; called with m_mutex held
+    void serve(WorkerState& worker) {
+        if (worker.wanted == 0) {
+            return;
+        }
+        std::vector<uint32_t> batch;
+        while (!m_pending.empty() && batch.size() < worker.wanted * 2) {
+            uint32_t id = m_pending.front();
+            m_pending.pop_front();
+            if (!m_tasks[id].done) {
+                batch.push_back(id);
+            }
+        }
+        if (batch.empty()) {
+            batch = steal(worker);
+        }
+        if (batch.empty()) {
+            // A worker that connects after the last result still needs to be let go
+            if (m_completed == m_tasks.size()) {
+                worker.connection->send({ 0, FrameType::WorkDone, "" });
+                worker.connection->shutdownBoth();
+            }
+            return;
+        }
+
+        std::string payload;
+        for (uint32_t id : batch) {
+            payload += std::to_string(id) + "\t" + m_tasks[id].hash + "\t" + m_tasks[id].relativePath + "\n";
+            worker.assigned.push_back(id);
+        }
+        worker.wanted = 0;
+        worker.connection->send({ 0, FrameType::WorkBatch, payload });
     }
 
-    std::string validate(const std::string& filePath) override {
-        // Use Node.js to validate and run the script
-        std::string checkCommand = "node --check " + escapeFilePath(filePath) + " 2>&1";
-        std::string checkResult = executeCommand(checkCommand);
+    // Takes the newer half of the unfinished files of the busiest other worker
+    std::vector<uint32_t> steal(WorkerState& thief) {
+        WorkerState* victim = nullptr;
+        for (auto& [id, worker] : m_workers) {
+            if (&worker != &thief && worker.assigned.size() > 1 && (!victim || worker.assigned.size() > victim->assigned.size())) {
+                victim = &worker;
+            }
+        }
+        if (!victim) {
+            return {};
+        }
 
-        if (!checkResult.empty()) {
-            return "Syntax errors:\n" + checkResult;
+        size_t keep = (victim->assigned.size() + 1) / 2;
+        std::vector<uint32_t> stolen(victim->assigned.begin() + keep, victim->assigned.end());
+        victim->assigned.resize(keep);
+        std::string payload;
+        for (uint32_t id : stolen) {
+            payload += std::to_string(id) + "\n";
+        }
+        victim->connection->send({ 0, FrameType::WorkRevoke, payload });
+        return stolen;
+    }
+
+    void serveWaiting() {
+        for (auto& [id, worker] : m_workers) {
+            serve(worker);
         }
+    }
 
-        std::string runCommand = "node " + escapeFilePath(filePath) + " 2>&1";
-        std::string runResult = executeCommand(runCommand);
+    // Records a result unless another worker already delivered this file's
+    void finish(WorkerState& worker, uint32_t id, const std::string& payload) {
+        auto assigned = std::find(worker.assigned.begin(), worker.assigned.end(), id);
+        if (assigned != worker.assigned.end()) {
+            worker.assigned.erase(assigned);
+        }
+        if (id >= m_tasks.size() || m_tasks[id].done) {
+            return;
+        }
 
-        return "Compilation successful.\nExecution output:\n" + runResult;
+        // "<1|0>\n<milliseconds>\n<result>"
+        size_t first = payload.find('\n');
+        size_t second = first == std::string::npos ? std::string::npos : payload.find('\n', first + 1);
+        if (second == std::string::npos) {
+            return;
+        }
+        bool succeeded = payload.compare(0, first, "1") == 0;
+        m_tasks[id].done = true;
+        m_completed++;
+        if (!succeeded) {
+            m_failures++;
+        }
+        std::cout << "== " << m_tasks[id].relativePath << ": " << (succeeded ? "ok" : "failed") << " ("
+            << payload.substr(first + 1, second - first - 1) << " ms on " << worker.name << ")\n"
+            << payload.substr(second + 1) << "\n" << std::flush;
+        if (m_completed == m_tasks.size()) {
+            m_allDone.notify_all();
+        }
     }
+
+    std::filesystem::path m_root;
+    std::string m_address;
+    std::vector<FileTask> m_tasks;
+    std::deque<uint32_t> m_pending;
+    std::map<uint32_t, WorkerState> m_workers;
+    uint32_t m_nextWorkerId = 0;
+    size_t m_completed = 0;
+    size_t m_failures = 0;
+    // Accept and connection threads still running
+    size_t m_threads = 0;
+    std::mutex m_mutex;
+    std::condition_variable m_allDone;
 };
 
-std::unique_ptr<LanguageValidator> getValidator(const std::string& language, const std::string& filePath) {
-    if (language == "Auto-detect") {
-        std::filesystem::path path(filePath);
-        std::string extension = path.extension().string();
+// Validates files a coordinator hands out, from its own copy of the tree, and streams each
+// result back as it finishes. Runs until the coordinator reports that all files are done.
+class ShardWorker {
+public:
+    ShardWorker(const std::filesystem::path& root, std::string address, size_t slots)
+        : m_root(std::filesystem::absolute(root)), m_address(std::move(address)), m_slots(std::max<size_t>(1, slots)), m_runner(m_root) {}
 
-        if (extension == ".java") return std::make_unique<JavaValidator>();
-        if (extension == ".py") return std::make_unique<PythonValidator>();
-        if (extension == ".php") return std::make_unique<PHPValidator>();
-        if (extension == ".js") return std::make_unique<JavaScriptValidator>();
+    int run() {
+        if (!SocketConnection::startWinsock()) {
+            std::cerr << "Cannot start Winsock\n";
+            return 1;
+        }
+        m_connection = SocketConnection::connectTo(m_address);
+        if (!m_connection) {
+            std::cerr << "Cannot connect to " << m_address << "\n";
+            return 1;
+        }
 
-        return nullptr;
+        std::vector<std::thread> threads;
+        for (size_t i = 0; i < m_slots; ++i) {
+            threads.emplace_back(&ShardWorker::validateLoop, this);
+        }
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            requestWork();
+        }
+
+        bool completed = false;
+        Frame frame;
+        while (!completed && m_connection->read(frame)) {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            if (frame.type == FrameType::WorkBatch) {
+                addBatch(frame.payload);
+                m_requestPending = false;
+                m_wake.notify_all();
+                requestWork();
+            }
+            else if (frame.type == FrameType::WorkRevoke) {
+                std::set<std::string> revoked;
+                for (const auto& id : splitString(frame.payload, '\n')) {
+                    revoked.insert(id);
+                }
+                m_queue.erase(std::remove_if(m_queue.begin(), m_queue.end(),
+                    [&](const WorkItem& item) { return revoked.count(std::to_string(item.id)) > 0; }), m_queue.end());
+                requestWork();
+            }
+            else if (frame.type == FrameType::WorkDone) {
+                completed = true;
+            }
+        }
+
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_stopping = true;
+            m_queue.clear();
+        }
+        m_wake.notify_all();
+        for (auto& thread : threads) {
+            thread.join();
+        }
+        return completed ? 0 : 1;
     }
-    else if (language == "Java") return std::make_unique<JavaValidator>();
-    else if (language == "Python") return std::make_unique<PythonValidator>();
-    else if (language == "PHP") return std::make_unique<PHPValidator>();
-    else if (language == "JavaScript") return std::make_unique<JavaScriptValidator>();
 
-    return nullptr;
-}
+private:
+    struct WorkItem {
+        uint32_t id = 0;
+        std::string hash;
+        std::string relativePath;
+    };
+
+    void addBatch(const std::string& payload) {
+        for (const auto& line : splitString(payload, '\n')) {
+            std::vector<std::string> fields = splitString(line, '\t');
+            if (fields.size() != 3) {
+                continue;
+            }
+            try {
+                m_queue.push_back({ static_cast<uint32_t>(std::stoul(fields[0])), fields[1], fields[2] });
+            }
+            catch (...) {
+            }
+        }
+    }
+
+    // Asks for as many files as there are free slots, with one request outstanding at a
+    // time; called with m_mutex held
+    void requestWork() {
+        size_t held = m_queue.size() + m_running;
+        if (m_requestPending || m_stopping || held >= m_slots) {
+            return;
+        }
+        m_requestPending = true;
+        m_connection->send({ 0, FrameType::WorkRequest, std::to_string(m_slots - held) });
+    }
+
+    void validateLoop() {
+        t_priority = Priority::Background;
+        for (;;) {
+            WorkItem item;
+            {
+                std::unique_lock<std::mutex> lock(m_mutex);
+                m_wake.wait(lock, [this] { return m_stopping || !m_queue.empty(); });
+                if (m_queue.empty()) {
+                    return;
+                }
+                item = std::move(m_queue.front());
+                m_queue.pop_front();
+                m_running++;
+            }
+
+            auto start = std::chrono::steady_clock::now();
+            bool passed = false;
+            std::string result = validate(item, passed);
+            double milliseconds = ValidationTimings::millisecondsSince(start);
+            m_connection->send({ item.id, FrameType::WorkResult, std::string(passed ? "1" : "0") + "\n"
+                + std::to_string(static_cast<int>(milliseconds)) + "\n" + result });
+
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_running--;
+            requestWork();
+        }
+    }
+
+    std::string validate(const WorkItem& item, bool& passed) {
+        // Only paths inside the tree are accepted
+        std::filesystem::path relative = std::filesystem::path(toWide(item.relativePath)).lexically_normal();
+        if (relative.empty() || relative.is_absolute() || relative.has_root_name() || *relative.begin() == "..") {
+            return "Invalid path from coordinator: " + item.relativePath;
+        }
+        std::filesystem::path file = m_root / relative;
+        if (toHex(fnv1a64(readFileContents(file))) != item.hash) {
+            return "File differs from the coordinator's copy: " + item.relativePath;
+        }
+        return m_runner.validateOne(file, &passed);
+    }
+
+    std::filesystem::path m_root;
+    std::string m_address;
+    size_t m_slots;
+    BatchRunner m_runner;
+    std::unique_ptr<SocketConnection> m_connection;
+    std::mutex m_mutex;
+    std::condition_variable m_wake;
+    std::deque<WorkItem> m_queue;
+    size_t m_running = 0;
+    bool m_requestPending = false;
+    bool m_stopping = false;
+};
 
 // Function to validate code
 void validateCode(HWND hwnd) {
@@ -227,44 +6589,23 @@ void validateCode(HWND hwnd) {
 
     // Run validation in a separate thread
     std::thread validationThread([hwnd, filePath, language]() {
-        std::string result;
-
-        try {
-            if (filePath.empty()) {
-                result = "Please select a file to validate.";
-            }
-            else {
-                // Check if file exists
-                if (!std::filesystem::exists(filePath)) {
-                    result = "File does not exist: " + filePath;
-                }
-                else {
-                    // Get appropriate validator
-                    auto validator = getValidator(language, filePath);
+        std::wstring wideResult;
 
-                    if (!validator) {
-                        result = "Unsupported file type or language selection.";
-                    }
-                    else if (!validator->isCompatible(filePath)) {
-                        result = "Selected language doesn't match the file extension.";
-                    }
-                    else {
-                        result = validator->validate(filePath);
-                    }
-                }
-            }
+        // Prefer a running daemon for its warm caches, otherwise validate in-process.
+        // Large daemon results are converted straight from the shared section.
+        ValidationRequest request;
+        request.filePath = filePath;
+        request.language = language;
+        request.options["shm"] = "1";
+        request.options["priority"] = "interactive";
+        DaemonResult daemonResult;
+        if (!filePath.empty() && requestFromDaemon(request, daemonResult)) {
+            wideResult = toWide(daemonResult.text());
         }
-        catch (const std::exception& e) {
-            result = "Error occurred during validation: " + std::string(e.what());
+        else {
+            auto validator = getValidator(language, filePath);
+            wideResult = toWide(validateFile(validator.get(), filePath));
         }
-        catch (...) {
-            result = "Unknown error occurred during validation.";
-        }
-
-        int size_needed = MultiByteToWideChar(CP_UTF8, 0, result.c_str(), -1, nullptr, 0);
-        std::wstring wideResult(size_needed, 0);
-        MultiByteToWideChar(CP_UTF8, 0, result.c_str(), -1, &wideResult[0], size_needed);
-        wideResult.resize(size_needed - 1); 
 
         // Update UI from the main thread
         SendMessage(hwnd, WM_APP, 0, reinterpret_cast<LPARAM>(new std::wstring(wideResult)));
@@ -436,6 +6777,83 @@ LRESULT CALLBACK WindowProc(HWND hwnd, UINT uMsg, WPARAM wParam, LPARAM lParam)
 int WINAPI WinMain(HINSTANCE hInstance, HINSTANCE hPrevInstance, LPSTR lpCmdLine, int nCmdShow) {
     const wchar_t CLASS_NAME[] = L"CodeValidatorWindowClass";
 
+    std::vector<std::string> args = getCommandLineArgs();
+    if (!args.empty() && args[0] == "--daemon") {
+        return ValidationDaemon().run();
+    }
+    if (!args.empty() && args[0] == "--benchmark") {
+        return runBenchmark();
+    }
+    if (args.size() >= 2 && (args[0] == "--batch" || args[0] == "--watch")) {
+        attachParentConsole();
+        BatchRunner runner(std::filesystem::path(toWide(args[1])));
+        std::string changedSince;
+        if (args[0] == "--batch") {
+            runner.setFailFast(std::find(args.begin() + 2, args.end(), "--fail-fast") != args.end());
+            for (size_t i = 2; i < args.size(); i++) {
+                if (args[i].rfind("--shard=", 0) == 0) {
+                    char* end = nullptr;
+                    size_t index = static_cast<size_t>(std::strtoul(args[i].c_str() + 8, &end, 10));
+                    size_t count = *end == '/' ? static_cast<size_t>(std::strtoul(end + 1, &end, 10)) : 0;
+                    if (*end != '\0' || index < 1 || index > count) {
+                        std::cerr << "Invalid shard " << args[i].substr(8) << "\n";
+                        return 1;
+                    }
+                    runner.setShard(index, count);
+                }
+                else if (args[i] == "--results" && i + 1 < args.size()) {
+                    runner.setResultsPath(std::filesystem::path(toWide(args[++i])));
+                }
+                else if (args[i] == "--timings" && i + 1 < args.size() && !runner.loadTimings(std::filesystem::path(toWide(args[++i])))) {
+                    std::cerr << "Cannot read timings from " << args[i] << "\n";
+                    return 1;
+                }
+                else if (args[i] == "--changed-since" && i + 1 < args.size()) {
+                    changedSince = args[++i];
+                }
+            }
+        }
+        if (args[0] == "--watch") {
+            return runner.watch();
+        }
+        if (!changedSince.empty()) {
+            return runner.validateChangedSince(changedSince) == 0 ? 0 : 1;
+        }
+        return runner.validateAll() == 0 ? 0 : 1;
+    }
+    if (!args.empty() && args[0] == "--pre-commit") {
+        attachParentConsole();
+        BatchRunner runner(std::filesystem::path(toWide(args.size() >= 2 ? args[1] : ".")));
+        return runner.validateStaged() == 0 ? 0 : 1;
+    }
+    if (args.size() >= 2 && args[0] == "--merge") {
+        attachParentConsole();
+        std::vector<std::filesystem::path> inputs;
+        std::filesystem::path output;
+        for (size_t i = 1; i < args.size(); i++) {
+            if (args[i] == "--output" && i + 1 < args.size()) {
+                output = std::filesystem::path(toWide(args[++i]));
+            }
+            else {
+                inputs.push_back(std::filesystem::path(toWide(args[i])));
+            }
+        }
+        return mergeBatchResults(inputs, output);
+    }
+    if (args.size() >= 2 && args[0] == "--coordinator") {
+        attachParentConsole();
+        std::string address = args.size() >= 4 && args[2] == "--listen" ? args[3] : DEFAULT_COORDINATOR_ADDRESS;
+        return ShardCoordinator(std::filesystem::path(toWide(args[1])), address).run();
+    }
+    if (args.size() >= 3 && args[0] == "--worker") {
+        attachParentConsole();
+        size_t slots = std::max(1u, std::thread::hardware_concurrency());
+        if (args.size() >= 5 && args[3] == "--slots") {
+            slots = static_cast<size_t>(std::strtoul(args[4].c_str(), nullptr, 10));
+        }
+        return ShardWorker(std::filesystem::path(toWide(args[2])), args[1], slots).run();
+    }
+
     WNDCLASS wc = {};
     wc.lpfnWndProc = WindowProc;
     wc.hInstance = hInstance;